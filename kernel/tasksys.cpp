@@ -43,7 +43,8 @@
   There are several task systems in this file, built using:
     - Microsoft's Concurrency Runtime (ISPC_USE_CONCRT)
     - Apple's Grand Central Dispatch (ISPC_USE_GCD)
-    - bare pthreads (ISPC_USE_PTHREADS, ISPC_USE_PTHREADS_FULLY_SUBSCRIBED)
+    - bare pthreads (ISPC_USE_PTHREADS, ISPC_USE_PTHREADS_FULLY_SUBSCRIBED,
+      ISPC_USE_PTHREADS_WORK_STEALING)
     - Cilk Plus (ISPC_USE_CILK)
     - TBB (ISPC_USE_TBB_TASK_GROUP, ISPC_USE_TBB_PARALLEL_FOR)
     - OpenMP (ISPC_USE_OMP)
@@ -59,6 +60,7 @@
 #define ISPC_USE_CONCRT
 #define ISPC_USE_PTHREADS
 #define ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+#define ISPC_USE_PTHREADS_WORK_STEALING
 #define ISPC_USE_CILK
 #define ISPC_USE_OMP
 #define ISPC_USE_TBB_TASK_GROUP
@@ -68,6 +70,16 @@
   by assigning one pthread to each hyper-thread, and then uses spinlocks and atomics
   for task management.  This model is useful for KNC where tasks can take over 
   the machine, but less so when there are other tasks that need running on the machine.
+  Workers spin on a ring of live launches, which keeps launch latency low, and every
+  sync waits for all of them to pass its launch, so tasks must not launch and sync
+  tasks of their own under this model.
+
+  The ISPC_USE_PTHREADS_WORK_STEALING model gives every worker thread (and
+  every other thread that launches tasks) its own lock-free Chase-Lev deque.
+  Launched tasks go on the launching thread's deque, idle threads steal from
+  randomly chosen victims, and sleeping workers are woken once per launch
+  rather than once per task.  No lock is taken on the task path, which
+  matters when thousands of small tasks are launched on many cores.
 
 #define ISPC_USE_CREW
 #define ISPC_USE_HPX
@@ -81,6 +93,7 @@
 
 #if !(defined ISPC_USE_CONCRT          || defined ISPC_USE_GCD              || \
       defined ISPC_USE_PTHREADS        || defined ISPC_USE_PTHREADS_FULLY_SUBSCRIBED || \
+      defined ISPC_USE_PTHREADS_WORK_STEALING || \
       defined ISPC_USE_TBB_TASK_GROUP  || defined ISPC_USE_TBB_PARALLEL_FOR || \
       defined ISPC_USE_OMP             || defined ISPC_USE_CILK             || \
       defined ISPC_USE_HPX)
@@ -110,6 +123,13 @@
 #define ISPC_IS_KNC
 #endif
 
+// Task systems that are handed each launch as a single range of task
+// indices, described by one TaskInfo, and split it up themselves.  The
+// others get one TaskInfo per task.
+#if defined(ISPC_USE_PTHREADS) || defined(ISPC_USE_PTHREADS_WORK_STEALING)
+#define ISPC_RANGE_LAUNCHES
+#endif
+
 
 #define DBG(x) 
 
@@ -134,7 +154,9 @@
   #include <sys/types.h>
   #include <sys/stat.h>
   #include <sys/param.h>
+  #ifndef ISPC_IS_LINUX
   #include <sys/sysctl.h>
+  #endif
   #include <vector>
   #include <algorithm>
 #endif // ISPC_USE_PTHREADS
@@ -147,12 +169,21 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#ifndef ISPC_IS_LINUX
 #include <sys/sysctl.h>
+#endif
 #include <vector>
 #include <algorithm>
 //#include <stdexcept>
 #include <stack>
 #endif // ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+#ifdef ISPC_USE_PTHREADS_WORK_STEALING
+  #include <pthread.h>
+  #include <unistd.h>
+  #include <errno.h>
+  #include <atomic>
+  #include <vector>
+#endif // ISPC_USE_PTHREADS_WORK_STEALING
 #ifdef ISPC_USE_TBB_PARALLEL_FOR
   #include <tbb/parallel_for.h>
 #endif // ISPC_USE_TBB_PARALLEL_FOR
@@ -171,7 +202,16 @@
 #endif // ISPC_USE_HPX
 #ifdef ISPC_IS_LINUX
   #include <malloc.h>
+  #include <sched.h>
+  #include <dirent.h>
 #endif // ISPC_IS_LINUX
+#ifdef ISPC_TASK_TRACE
+  #include <errno.h>
+  #include <time.h>
+  #ifndef ISPC_IS_WINDOWS
+  #include <dlfcn.h>
+  #endif
+#endif // ISPC_TASK_TRACE
 
 #include <stdio.h>
 #include <stdint.h>
@@ -179,6 +219,7 @@
 #include <assert.h>
 #include <string.h>
 #include <algorithm>
+#include <vector>
 
 // Signature of ispc-generated 'task' functions
 typedef void (*TaskFuncType)(void *data, int threadIndex, int threadCount,
@@ -186,6 +227,10 @@ typedef void (*TaskFuncType)(void *data, int threadIndex, int threadCount,
                              int taskIndex0, int taskIndex1, int taskIndex2,
                              int taskCount0, int taskCount1, int taskCount2);
 
+#if defined(ISPC_USE_PTHREADS_WORK_STEALING)
+class TaskGroup;
+#endif
+
 // Small structure used to hold the data for each task
 #ifdef _MSC_VER
 __declspec(align(32))
@@ -197,6 +242,9 @@ struct TaskInfo {
     int taskCount3d[3];
 #if defined(  ISPC_USE_CONCRT)
     event taskEvent;
+#endif
+#if defined(ISPC_USE_PTHREADS_WORK_STEALING)
+    TaskGroup *group;
 #endif
     int taskCount() const { return taskCount3d[0]*taskCount3d[1]*taskCount3d[2]; }
     int taskIndex0() const 
@@ -226,17 +274,46 @@ extern "C" {
     void ISPCLaunch(void **handlePtr, void *f, void *data, int countx, int county, int countz);
     void *ISPCAlloc(void **handlePtr, int64_t size, int32_t alignment);
     void ISPCSync(void *handle);
+
+    /* Chooses the worker thread count, CPU list and pinning policy ("none",
+       "compact" or "scatter") instead of ISPC_NUM_THREADS, ISPC_CPUS and
+       ISPC_PIN; 0, NULL and NULL keep the environment's or default choice.
+       Only has effect before the first launch; returns 0 if too late or
+       for backends that manage no threads of their own, 1 otherwise. */
+    int ISPCSetThreadConfig(int numThreads, const char *cpuList, const char *pinning);
+
+    /* Task graphs, for work that would otherwise be a chain of launch and
+       sync with every core idling at each sync until the slowest task of
+       the stage is done.  A node is `count` tasks of `func`, which start
+       once every node added as a dependency of it has finished; a node of
+       one task is a continuation.  ISPCGraphRun() runs the whole graph on
+       the task system's threads and returns 1 when it is done, and can be
+       called again to rerun it; it returns 0 without running anything if
+       the dependencies form a cycle. */
+    typedef void (*ISPCGraphTaskFunc)(void *data, int threadIndex, int threadCount,
+                                      int taskIndex, int taskCount);
+    void *ISPCGraphCreate();
+    int ISPCGraphAddNode(void *graph, ISPCGraphTaskFunc func, void *data, int count);
+    void ISPCGraphAddDependency(void *graph, int node, int dependency);
+    int ISPCGraphRun(void *graph);
+    void ISPCGraphDestroy(void *graph);
+
+    /* Task system tracing, see "Tracing" below; both do nothing unless
+       built with ISPC_TASK_TRACE.  ISPCTraceDump() returns 1 if the trace
+       was written. */
+    void ISPCTraceEnable(int enable);
+    int ISPCTraceDump(const char *path);
 }
 
 ///////////////////////////////////////////////////////////////////////////
 // TaskGroupBase
 
-#define LOG_TASK_QUEUE_CHUNK_SIZE 14
-#define MAX_TASK_QUEUE_CHUNKS 8
+/* Chunk k of TaskInfo structures holds TASK_QUEUE_CHUNK_SIZE << k of them,
+   so MAX_TASK_QUEUE_CHUNKS chunks cover every int index. */
+#define LOG_TASK_QUEUE_CHUNK_SIZE 8
+#define MAX_TASK_QUEUE_CHUNKS (32 - LOG_TASK_QUEUE_CHUNK_SIZE)
 #define TASK_QUEUE_CHUNK_SIZE (1<<LOG_TASK_QUEUE_CHUNK_SIZE)
 
-#define MAX_LAUNCHED_TASKS (MAX_TASK_QUEUE_CHUNKS * TASK_QUEUE_CHUNK_SIZE)
-
 #define NUM_MEM_BUFFERS 16
 
 class TaskGroup;
@@ -262,10 +339,9 @@ protected:
     int nextTaskInfoIndex;
 
 private:
-    /* We allocate blocks of TASK_QUEUE_CHUNK_SIZE TaskInfo structures as
-       needed by the calling function.  We hold up to MAX_TASK_QUEUE_CHUNKS
-       of these (and then exit at runtime if more than this many tasks are
-       launched.)
+    /* We allocate blocks of TaskInfo structures as needed by the calling
+       function, each twice the size of the previous one.  Blocks are never
+       moved, so workers can read a TaskInfo while more are allocated.
      */
     TaskInfo *taskInfo[MAX_TASK_QUEUE_CHUNKS];
 
@@ -303,6 +379,9 @@ inline TaskGroupBase::~TaskGroupBase() {
     // the "mem" member!
     for (int i = 1; i < NUM_MEM_BUFFERS; ++i)
         delete[](memBuffers[i]);
+
+    for (int i = 0; i < MAX_TASK_QUEUE_CHUNKS; ++i)
+        delete[](taskInfo[i]);
 }
 
 
@@ -324,20 +403,15 @@ TaskGroupBase::AllocTaskInfo(int count) {
 
 inline TaskInfo *
 TaskGroupBase::GetTaskInfo(int index) {
-    int chunk = (index >> LOG_TASK_QUEUE_CHUNK_SIZE);
-    int offset = index & (TASK_QUEUE_CHUNK_SIZE-1);
-
-    if (chunk == MAX_TASK_QUEUE_CHUNKS) {
-        fprintf(stderr, "A total of %d tasks have been launched from the "
-                "current function--the simple built-in task system can handle "
-                "no more. You can increase the values of TASK_QUEUE_CHUNK_SIZE "
-                "and LOG_TASK_QUEUE_CHUNK_SIZE to work around this limitation.  "
-                "Sorry!  Exiting.\n", index);
-        exit(1);
-    }
+    // Chunk k starts at index TASK_QUEUE_CHUNK_SIZE * (2^k - 1)
+    unsigned int blocks = ((unsigned int)index >> LOG_TASK_QUEUE_CHUNK_SIZE) + 1;
+    int chunk = 0;
+    while (blocks >> (chunk + 1))
+        ++chunk;
+    int offset = index - (int)(TASK_QUEUE_CHUNK_SIZE * ((1u << chunk) - 1));
 
     if (taskInfo[chunk] == NULL)
-        taskInfo[chunk] = new TaskInfo[TASK_QUEUE_CHUNK_SIZE];
+        taskInfo[chunk] = new TaskInfo[TASK_QUEUE_CHUNK_SIZE << chunk];
     return &taskInfo[chunk][offset];
 }
 
@@ -358,8 +432,13 @@ TaskGroupBase::AllocMemory(int64_t size, int32_t alignment) {
     curMemBufferOffset = 0;
     assert(curMemBuffer < NUM_MEM_BUFFERS);
 
+    // Buffers outlive Reset(), so reuse the next one if it is big enough
+    if (memBufferSize[curMemBuffer] >= size + alignment)
+        return AllocMemory(size, alignment);
+
     int allocSize = 1 << (12 + curMemBuffer);
     allocSize = std::max(int(size+alignment), allocSize);
+    delete[](memBuffers[curMemBuffer]);
     char *newBuf = new char[allocSize];
     memBufferSize[curMemBuffer] = allocSize;
     memBuffers[curMemBuffer] = newBuf;
@@ -401,15 +480,597 @@ lAtomicCompareAndSwap32(volatile int32_t *v, int32_t newValue, int32_t oldValue)
 #endif // ISPC_IS_WINDOWS
 }
 
+// Returns the value *v had before the add
 static inline int32_t 
 lAtomicAdd(volatile int32_t *v, int32_t delta) {
 #ifdef ISPC_IS_WINDOWS
-    return InterlockedExchangeAdd((volatile LONG *)v, delta)+delta;
+    return InterlockedExchangeAdd((volatile LONG *)v, delta);
 #else
     return __sync_fetch_and_add(v, delta);
 #endif
 }
 
+static inline void
+lPause() {
+#if defined ISPC_IS_WINDOWS
+    YieldProcessor();
+#elif defined ISPC_IS_KNC
+    _mm_delay_32(8);
+#elif defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Tracing
+
+/* Built with ISPC_TASK_TRACE, every thread that runs or launches tasks can
+   record what it does into a ring buffer of its own: ranges of tasks run,
+   launches, syncs, time parked and steals.  Recording is off until
+   ISPCTraceEnable(1) is called, or from the start if ISPC_TRACE names a
+   file to dump the trace to at exit.  ISPCTraceDump() writes the events
+   still in the buffers as Chrome Trace Event JSON, for chrome://tracing
+   or Perfetto; call it while no tasks run.  Task functions show up by
+   address, as module+offset for addr2line where that is known.  Without
+   ISPC_TASK_TRACE all of this compiles away. */
+
+enum TraceEventType {
+    TRACE_TASKS,    // tasks [a, b) of func ran
+    TRACE_LAUNCH,   // b tasks of func were launched
+    TRACE_SYNC,     // waited in a sync
+    TRACE_IDLE,     // a worker was parked
+    TRACE_STEAL,    // took work from thread a's deque
+};
+
+#ifdef ISPC_TASK_TRACE
+
+/* Events kept per thread; older ones are overwritten. */
+#define LOG_TRACE_RING_SIZE 16
+#define TRACE_RING_SIZE (1 << LOG_TRACE_RING_SIZE)
+#define MAX_TRACE_THREADS 256
+
+#ifdef ISPC_IS_WINDOWS
+#define TRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define TRACE_THREAD_LOCAL __thread
+#endif
+
+struct TraceEvent {
+    uint64_t start, end;  // ns
+    const void *func;
+    int32_t type;
+    int32_t a, b;
+};
+
+struct TraceBuffer {
+    volatile int64_t next;  // written only by the owning thread
+    TraceEvent events[TRACE_RING_SIZE];
+};
+
+static volatile bool traceEnabled = false;
+static uint64_t traceStart;
+static TraceBuffer *traceBuffers[MAX_TRACE_THREADS];
+static volatile int32_t nTraceBuffers = 0;
+static TRACE_THREAD_LOCAL TraceBuffer *lTraceBuffer = NULL;
+
+static inline uint64_t
+lTraceNow() {
+#ifdef ISPC_IS_WINDOWS
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)(count.QuadPart * (1e9 / frequency.QuadPart));
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+/* The calling thread's buffer, registered on first use; NULL once there
+   are MAX_TRACE_THREADS. */
+static TraceBuffer *
+lTraceThreadBuffer() {
+    if (lTraceBuffer == NULL) {
+        int index = lAtomicAdd(&nTraceBuffers, 1);
+        if (index >= MAX_TRACE_THREADS)
+            return NULL;
+        TraceBuffer *buffer = new TraceBuffer;
+        buffer->next = 0;
+        traceBuffers[index] = buffer;
+        lTraceBuffer = buffer;
+    }
+    return lTraceBuffer;
+}
+
+static inline void
+lTraceRecord(TraceEventType type, uint64_t start, uint64_t end, const void *func, int a, int b) {
+    TraceBuffer *buffer = lTraceThreadBuffer();
+    if (buffer == NULL)
+        return;
+
+    TraceEvent &event = buffer->events[buffer->next & (TRACE_RING_SIZE - 1)];
+    event.start = start;
+    event.end = end;
+    event.func = func;
+    event.type = type;
+    event.a = a;
+    event.b = b;
+    buffer->next = buffer->next + 1;
+}
+
+/* The start time of an event to finish with lTraceEnd(), 0 when not
+   tracing. */
+static inline uint64_t
+lTraceBegin() {
+    return traceEnabled ? lTraceNow() : 0;
+}
+
+static inline void
+lTraceEnd(TraceEventType type, uint64_t start, const void *func = NULL, int a = 0, int b = 0) {
+    if (start != 0 && traceEnabled)
+        lTraceRecord(type, start, lTraceNow(), func, a, b);
+}
+
+static inline void
+lTraceInstant(TraceEventType type, const void *func = NULL, int a = 0, int b = 0) {
+    if (traceEnabled) {
+        uint64_t now = lTraceNow();
+        lTraceRecord(type, now, now, func, a, b);
+    }
+}
+
+#else
+
+static inline uint64_t lTraceBegin() { return 0; }
+static inline void lTraceEnd(TraceEventType, uint64_t, const void * = NULL, int = 0, int = 0) { }
+static inline void lTraceInstant(TraceEventType, const void * = NULL, int = 0, int = 0) { }
+
+#endif // ISPC_TASK_TRACE
+
+#ifdef ISPC_RANGE_LAUNCHES
+// Runs tasks [begin, end) of the launch described by ti, stepping the 3D
+// task index along rather than dividing it out for every task.
+static inline void
+lRunTaskRange(const TaskInfo *ti, int begin, int end, int threadIndex, int threadCount) {
+    const int count0 = ti->taskCount0(), count1 = ti->taskCount1(), count2 = ti->taskCount2();
+    const int count = ti->taskCount();
+
+    int index0 = begin % count0;
+    int index1 = (begin / count0) % count1;
+    int index2 = begin / (count0 * count1);
+    uint64_t rangeStart = lTraceBegin();
+
+    for (int i = begin; i < end; ++i) {
+        ti->func(ti->data, threadIndex, threadCount, i, count,
+                 index0, index1, index2, count0, count1, count2);
+
+        if (++index0 == count0) {
+            index0 = 0;
+            if (++index1 == count1) {
+                index1 = 0;
+                ++index2;
+            }
+        }
+    }
+
+    lTraceEnd(TRACE_TASKS, rangeStart, (const void *)ti->func, begin, end);
+}
+#endif // ISPC_RANGE_LAUNCHES
+
+///////////////////////////////////////////////////////////////////////////
+// Waiting
+
+#if defined(ISPC_USE_PTHREADS) || defined(ISPC_USE_PTHREADS_FULLY_SUBSCRIBED) || \
+    defined(ISPC_USE_PTHREADS_WORK_STEALING)
+
+/* How many times a waiting thread polls before it goes to sleep. */
+#define WAIT_SPIN_ROUNDS 4096
+
+/* Counts the unfinished tasks of a launch, plus one for the thread that
+   will wait on them.  Each finished task calls Done(); the waiting thread
+   polls Pending() while it can help or spin, then calls Wait(), which
+   gives up its own count and sleeps until the last task wakes it.  The
+   task that brings the count to zero signals under the mutex, so once
+   Wait() returns nothing touches the counter any more and it can be
+   reused.
+ */
+class SyncCounter {
+public:
+    SyncCounter() : count(1), finished(false) {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&cond, NULL);
+    }
+
+    ~SyncCounter() {
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    void Reset() {
+        count = 1;
+        finished = false;
+        lMemFence();
+    }
+
+    void Add(int tasks) {
+        __sync_fetch_and_add(&count, tasks);
+    }
+
+    bool Pending() const {
+        return count > 1;
+    }
+
+    void Done(int tasks = 1) {
+        lMemFence();
+        if (__sync_sub_and_fetch(&count, tasks) == 0)
+            Finish();
+    }
+
+    void Wait() {
+        if (__sync_sub_and_fetch(&count, 1) == 0)
+            return;
+
+        pthread_mutex_lock(&mutex);
+        while (!finished)
+            pthread_cond_wait(&cond, &mutex);
+        pthread_mutex_unlock(&mutex);
+    }
+
+private:
+    void Finish() {
+        pthread_mutex_lock(&mutex);
+        finished = true;
+        pthread_cond_signal(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+
+    volatile int32_t count;
+    bool finished;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+// Thread configuration
+
+#if defined(ISPC_USE_PTHREADS) || defined(ISPC_USE_PTHREADS_FULLY_SUBSCRIBED) || \
+    defined(ISPC_USE_PTHREADS_WORK_STEALING)
+
+/* How many worker threads there are and where they run.  Worked out once,
+   when the task system starts, from what ISPCSetThreadConfig() was given
+   before that, or else from the environment:
+
+     ISPC_NUM_THREADS  number of worker threads.  By default one fewer than
+                       the CPUs the process may use, since the thread that
+                       syncs helps out.
+     ISPC_CPUS         CPUs to run on, as a list like "0-7,16-23".  Only
+                       those that are also in the process affinity mask
+                       are used.
+     ISPC_PIN          "none" to let the OS place workers, "compact" to pin
+                       them filling one NUMA node before the next, or
+                       "scatter" to pin them round-robin across nodes.
+
+   The CPUs the process may use are its affinity mask, capped by the CPU
+   quota of its cgroup so a container is not oversubscribed.  NUMA nodes
+   come from /sys/devices/system/node; when workers are pinned, each knows
+   its node and the work-stealing backend steals within it first.
+ */
+enum PinPolicy {
+    PIN_DEFAULT,
+    PIN_NONE,
+    PIN_COMPACT,
+    PIN_SCATTER,
+};
+
+struct ThreadConfig {
+    int nThreads;
+    PinPolicy pin;
+    // Worker i runs on cpus[i % size] in node cpuNode[i % size] if pinned
+    std::vector<int> cpus;
+    std::vector<int> cpuNode;
+    int nNodes;
+};
+
+static ThreadConfig threadConfig;
+static volatile bool threadConfigDone = false;
+
+static int requestedThreads = 0;
+static char *requestedCpus = NULL;
+static PinPolicy requestedPin = PIN_DEFAULT;
+
+
+static bool
+lParsePinPolicy(const char *name, PinPolicy *pin) {
+    if (strcmp(name, "none") == 0)
+        *pin = PIN_NONE;
+    else if (strcmp(name, "compact") == 0)
+        *pin = PIN_COMPACT;
+    else if (strcmp(name, "scatter") == 0)
+        *pin = PIN_SCATTER;
+    else
+        return false;
+    return true;
+}
+
+
+/* Parses a CPU list in the format of sysfs and cpusets, "0-3,8,10-11". */
+static bool
+lParseCpuList(const char *list, std::vector<int> *cpus) {
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return false;
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return false;
+        }
+        if (last >= 65536)
+            return false;
+        for (long cpu = first; cpu <= last; ++cpu)
+            cpus->push_back((int)cpu);
+
+        p = end;
+        if (*p == ',')
+            ++p;
+        else if (*p != '\0' && *p != '\n')
+            return false;
+    }
+    return true;
+}
+
+
+static bool
+lReadFile(const char *path, char *buf, int size) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return false;
+    int n = (int)fread(buf, 1, size - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    return n > 0;
+}
+
+
+/* The CPUs the process is allowed to run on. */
+static void
+lAllowedCpus(std::vector<int> *cpus) {
+#ifdef ISPC_IS_LINUX
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &mask))
+                cpus->push_back(cpu);
+        if (!cpus->empty())
+            return;
+    }
+#endif
+    int n = std::max((int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+    for (int cpu = 0; cpu < n; ++cpu)
+        cpus->push_back(cpu);
+}
+
+
+/* How many CPUs' worth of time the cgroup CPU quota allows, or 0 if there
+   is no quota. */
+static int
+lCgroupCpuLimit() {
+#ifdef ISPC_IS_LINUX
+    char buf[512], path[600];
+    long long quota, period;
+
+    // cgroup v2: "0::/path" in /proc/self/cgroup, "quota period" in cpu.max
+    const char *group = "";
+    if (lReadFile("/proc/self/cgroup", buf, sizeof(buf))) {
+        char *line = strstr(buf, "0::/");
+        if (line == buf || (line != NULL && line[-1] == '\n')) {
+            group = line + 3;
+            line[strcspn(line, "\n")] = '\0';
+        }
+    }
+    snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max", strcmp(group, "/") == 0 ? "" : group);
+    if (!lReadFile(path, buf, sizeof(buf)))
+        lReadFile("/sys/fs/cgroup/cpu.max", buf, sizeof(buf));
+    if (sscanf(buf, "%lld %lld", &quota, &period) == 2 && quota > 0 && period > 0)
+        return (int)((quota + period - 1) / period);
+    if (strncmp(buf, "max", 3) == 0)
+        return 0;
+
+    // cgroup v1
+    if (lReadFile("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", buf, sizeof(buf)) &&
+        sscanf(buf, "%lld", &quota) == 1 && quota > 0 &&
+        lReadFile("/sys/fs/cgroup/cpu/cpu.cfs_period_us", buf, sizeof(buf)) &&
+        sscanf(buf, "%lld", &period) == 1 && period > 0)
+        return (int)((quota + period - 1) / period);
+#endif
+    return 0;
+}
+
+
+/* Looks up the NUMA node of each of `cpus`, numbering the nodes that have
+   any of them from 0.  Everything is node 0 without sysfs. */
+static int
+lCpuNodes(const std::vector<int> &cpus, std::vector<int> *cpuNode) {
+    cpuNode->assign(cpus.size(), 0);
+    int nNodes = 1;
+#ifdef ISPC_IS_LINUX
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (dir == NULL)
+        return nNodes;
+
+    std::vector<int> nodeIds;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int id;
+        char tail;
+        if (sscanf(entry->d_name, "node%d%c", &id, &tail) == 1)
+            nodeIds.push_back(id);
+    }
+    closedir(dir);
+    std::sort(nodeIds.begin(), nodeIds.end());
+
+    nNodes = 0;
+    for (size_t n = 0; n < nodeIds.size(); ++n) {
+        char path[64], buf[1024];
+        std::vector<int> nodeCpus;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodeIds[n]);
+        if (!lReadFile(path, buf, sizeof(buf)) || !lParseCpuList(buf, &nodeCpus))
+            continue;
+
+        bool used = false;
+        for (size_t i = 0; i < cpus.size(); ++i) {
+            if (std::find(nodeCpus.begin(), nodeCpus.end(), cpus[i]) != nodeCpus.end()) {
+                (*cpuNode)[i] = nNodes;
+                used = true;
+            }
+        }
+        if (used)
+            ++nNodes;
+    }
+    nNodes = std::max(nNodes, 1);
+#endif
+    return nNodes;
+}
+
+
+/* Works out threadConfig, see above.  Called once by InitTaskSystem(),
+   under its lock; defaultPin is the backend's pinning policy when neither
+   ISPCSetThreadConfig() nor ISPC_PIN chose one. */
+static void
+lResolveThreadConfig(PinPolicy defaultPin) {
+    if (threadConfigDone)
+        return;
+
+    ThreadConfig &config = threadConfig;
+    std::vector<int> allowed;
+    lAllowedCpus(&allowed);
+
+    const char *cpuList = requestedCpus != NULL ? requestedCpus : getenv("ISPC_CPUS");
+    std::vector<int> wanted;
+    if (cpuList != NULL && !lParseCpuList(cpuList, &wanted)) {
+        fprintf(stderr, "Ignoring malformed CPU list \"%s\"\n", cpuList);
+        wanted.clear();
+        cpuList = NULL;
+    }
+    for (size_t i = 0; i < allowed.size(); ++i)
+        if (cpuList == NULL || std::find(wanted.begin(), wanted.end(), allowed[i]) != wanted.end())
+            config.cpus.push_back(allowed[i]);
+    if (config.cpus.empty()) {
+        fprintf(stderr, "No usable CPUs in \"%s\", using all allowed ones\n", cpuList);
+        config.cpus = allowed;
+    }
+
+    std::vector<int> nodes;
+    config.nNodes = lCpuNodes(config.cpus, &nodes);
+
+    config.pin = requestedPin;
+    const char *pin = getenv("ISPC_PIN");
+    if (config.pin == PIN_DEFAULT && pin != NULL && !lParsePinPolicy(pin, &config.pin))
+        fprintf(stderr, "Ignoring unknown ISPC_PIN policy \"%s\"\n", pin);
+    if (config.pin == PIN_DEFAULT)
+        config.pin = defaultPin;
+
+    // Order the CPUs for pinning: by node, then either node after node
+    // (compact) or taking one from each node in turn (scatter)
+    std::vector<std::vector<int> > byNode(config.nNodes);
+    for (size_t i = 0; i < config.cpus.size(); ++i)
+        byNode[nodes[i]].push_back(config.cpus[i]);
+    config.cpus.clear();
+    config.cpuNode.clear();
+    if (config.pin == PIN_SCATTER) {
+        for (size_t i = 0; config.cpus.size() < nodes.size(); ++i)
+            for (int n = 0; n < config.nNodes; ++n)
+                if (i < byNode[n].size()) {
+                    config.cpus.push_back(byNode[n][i]);
+                    config.cpuNode.push_back(n);
+                }
+    }
+    else {
+        for (int n = 0; n < config.nNodes; ++n)
+            for (size_t i = 0; i < byNode[n].size(); ++i) {
+                config.cpus.push_back(byNode[n][i]);
+                config.cpuNode.push_back(n);
+            }
+    }
+
+    int available = (int)config.cpus.size();
+    int quota = lCgroupCpuLimit();
+    if (quota > 0)
+        available = std::min(available, quota);
+
+    const char *threads = getenv("ISPC_NUM_THREADS");
+    if (requestedThreads > 0)
+        config.nThreads = requestedThreads;
+    else if (threads != NULL && atoi(threads) > 0)
+        config.nThreads = atoi(threads);
+    else
+        config.nThreads = available - 1;
+
+    DBG(fprintf(stderr, "%d workers on %d cpus in %d nodes, pinning %d\n", config.nThreads,
+                (int)config.cpus.size(), config.nNodes, (int)config.pin));
+
+    lMemFence();
+    threadConfigDone = true;
+}
+
+
+/* The NUMA node worker `worker` is pinned to, or -1 if it is not pinned. */
+static inline int
+lWorkerNode(int worker) {
+    if (threadConfig.pin == PIN_NONE)
+        return -1;
+    return threadConfig.cpuNode[worker % threadConfig.cpuNode.size()];
+}
+
+
+/* Sets up `attr` to create worker `worker` on its CPU, if workers are
+   pinned. */
+static void
+lPinWorker(pthread_attr_t *attr, int worker) {
+#ifdef ISPC_IS_LINUX
+    if (threadConfig.pin == PIN_NONE)
+        return;
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(threadConfig.cpus[worker % threadConfig.cpus.size()], &cpuset);
+    int err = pthread_attr_setaffinity_np(attr, sizeof(cpuset), &cpuset);
+    if (err != 0)
+        fprintf(stderr, "Error pinning pthread %d: %s\n", worker, strerror(err));
+#endif
+}
+
+
+int
+ISPCSetThreadConfig(int numThreads, const char *cpuList, const char *pinning) {
+    PinPolicy pin = PIN_DEFAULT;
+    if (threadConfigDone || (pinning != NULL && !lParsePinPolicy(pinning, &pin)))
+        return 0;
+
+    requestedThreads = numThreads;
+    free(requestedCpus);
+    requestedCpus = cpuList != NULL ? strdup(cpuList) : NULL;
+    requestedPin = pin;
+    return 1;
+}
+
+#else
+
+int
+ISPCSetThreadConfig(int, const char *, const char *) {
+    // Threads are managed by the underlying runtime
+    return 0;
+}
+
+#endif
+
 ///////////////////////////////////////////////////////////////////////////
 
 #ifdef ISPC_USE_CONCRT
@@ -442,18 +1103,18 @@ private:
 
 #ifdef ISPC_USE_PTHREADS
 static void *lTaskEntry(void *arg);
+static bool lTakeTasks(TaskGroup *preferred, TaskGroup **tg, TaskInfo **ti, int *begin, int *end);
 
 class TaskGroup : public TaskGroupBase {
 public:
     TaskGroup() {
-        numUnfinishedTasks = 0;
-        waitingTasks.reserve(128);
+        waitingRanges.reserve(16);
         inActiveList = false;
     }
 
     void Reset() {
         TaskGroupBase::Reset();
-        numUnfinishedTasks = 0;
+        unfinished.Reset();
         assert(inActiveList == false);
         lMemFence();
     }
@@ -463,15 +1124,45 @@ public:
 
 private:
     friend void *lTaskEntry(void *arg);
+    friend bool lTakeTasks(TaskGroup *, TaskGroup **, TaskInfo **, int *, int *);
+
+    /* Tasks [begin, end) of the launch described by TaskInfo `info` that
+       no thread has started yet. */
+    struct WaitingRange {
+        int info;
+        int begin;
+        int end;
+    };
 
-    int32_t numUnfinishedTasks;
-    int32_t pad[3];
-    std::vector<int> waitingTasks;
+    SyncCounter unfinished;
+    std::vector<WaitingRange> waitingRanges;
     bool inActiveList;
 };
 
 #endif // ISPC_USE_PTHREADS
 
+#ifdef ISPC_USE_PTHREADS_WORK_STEALING
+struct WorkItem;
+static void lRunItem(WorkItem item, int slot);
+
+class TaskGroup : public TaskGroupBase {
+public:
+    void Reset() {
+        TaskGroupBase::Reset();
+        unfinished.Reset();
+    }
+
+    void Launch(int baseIndex, int count);
+    void Sync();
+
+private:
+    friend void lRunItem(WorkItem item, int slot);
+
+    SyncCounter unfinished;
+};
+
+#endif // ISPC_USE_PTHREADS_WORK_STEALING
+
 #ifdef ISPC_USE_CILK
 
 class TaskGroup : public TaskGroupBase {
@@ -529,6 +1220,22 @@ private:
 
 #endif // ISPC_USE_HPX
 
+#ifdef ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+struct Task;
+
+/* Each launch goes to the live task ring as a Task of its own; the group
+   only remembers them for ISPCSync() and pools their launch data. */
+class TaskGroup : public TaskGroupBase {
+public:
+    void Reset() {
+        TaskGroupBase::Reset();
+        launches.clear();
+    }
+
+    std::vector<Task *> launches;
+};
+#endif // ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+
 ///////////////////////////////////////////////////////////////////////////
 
 ///////////////////////////////////////////////////////////////////////////
@@ -653,12 +1360,56 @@ static pthread_t *threads = NULL;
 
 static pthread_mutex_t taskSysMutex;
 static std::vector<TaskGroup *> activeTaskGroups;
+
+/* Index of the calling thread among the workers, -1 for other threads. */
+static __thread int lWorkerIndex = -1;
 static sem_t *workerSemaphore;
 
+/* Takes the next batch of waiting tasks, from `preferred` if it has any
+   and otherwise from the most recently activated task group.  Batches are
+   a fraction of what is left of the range, so a launch costs a few lock
+   acquisitions per thread rather than one per task, while the last tasks
+   are still handed out one at a time for load balance.  Must be called
+   with taskSysMutex held.
+ */
+static bool
+lTakeTasks(TaskGroup *preferred, TaskGroup **tg, TaskInfo **ti, int *begin, int *end) {
+    TaskGroup *from = preferred;
+    if (from == NULL || from->waitingRanges.size() == 0) {
+        if (activeTaskGroups.size() == 0)
+            return false;
+        from = activeTaskGroups.back();
+    }
+    assert(from->waitingRanges.size() > 0);
+
+    TaskGroup::WaitingRange &range = from->waitingRanges.back();
+    int batch = std::max(1, (range.end - range.begin) / (2 * (nThreads + 1)));
+
+    *tg = from;
+    *ti = from->GetTaskInfo(range.info);
+    *begin = range.begin;
+    *end = range.begin + batch;
+
+    range.begin += batch;
+    if (range.begin == range.end) {
+        from->waitingRanges.pop_back();
+        if (from->waitingRanges.size() == 0) {
+            // We just took the last task from this task group, so remove
+            // it from the active list.
+            activeTaskGroups.erase(std::find(activeTaskGroups.begin(),
+                                             activeTaskGroups.end(), from));
+            from->inActiveList = false;
+        }
+    }
+    return true;
+}
+
+
 static void *
 lTaskEntry(void *arg) {
     int threadIndex = (int)((int64_t)arg);
-    int threadCount = nThreads;
+    int threadCount = nThreads + 1;
+    lWorkerIndex = threadIndex;
 
     while (1) {
         int err;
@@ -666,67 +1417,49 @@ lTaskEntry(void *arg) {
         // Wait on the semaphore until we're woken up due to the arrival of
         // more work.
         //
-        if ((err = sem_wait(workerSemaphore)) != 0) {
+        uint64_t idleStart = lTraceBegin();
+        err = sem_wait(workerSemaphore);
+        lTraceEnd(TRACE_IDLE, idleStart);
+        if (err != 0) {
             fprintf(stderr, "Error from sem_wait: %s\n", strerror(err));
             exit(1);
         }
 
         //
-        // Acquire the mutex
+        // Keep taking batches of tasks until there are none left; a launch
+        // only posts once per worker, not once per task.
         //
-        if ((err = pthread_mutex_lock(&taskSysMutex)) != 0) {
-            fprintf(stderr, "Error from pthread_mutex_lock: %s\n", strerror(err));
-            exit(1);
-        }
+        while (1) {
+            if ((err = pthread_mutex_lock(&taskSysMutex)) != 0) {
+                fprintf(stderr, "Error from pthread_mutex_lock: %s\n", strerror(err));
+                exit(1);
+            }
+
+            TaskGroup *tg;
+            TaskInfo *ti;
+            int begin, end;
+            bool found = lTakeTasks(NULL, &tg, &ti, &begin, &end);
 
-        if (activeTaskGroups.size() == 0) {
-            //
-            // Task queue is empty, go back and wait on the semaphore
-            //
             if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
                 fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
                 exit(1);
             }
-            continue;
-        }
 
-        //
-        // Get the last task group on the active list and the last task
-        // from its waiting tasks list.
-        //
-        TaskGroup *tg = activeTaskGroups.back();
-        assert(tg->waitingTasks.size() > 0);
-        int taskNumber = tg->waitingTasks.back();
-        tg->waitingTasks.pop_back();
+            if (!found)
+                break;
 
-        if (tg->waitingTasks.size() == 0) {
-            // We just took the last task from this task group, so remove
-            // it from the active list.
-            activeTaskGroups.pop_back();
-            tg->inActiveList = false;
-        }
-    
-        if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
-            fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
-            exit(1);
-        }
-
-        //
-        // And now actually run the task
-        //
-        DBG(fprintf(stderr, "running task %d from group %p\n", taskNumber, tg));
-        TaskInfo *myTask = tg->GetTaskInfo(taskNumber);
-        myTask->func(myTask->data, threadIndex, threadCount, myTask->taskIndex,
-                     myTask->taskCount(),
-            myTask->taskIndex0(), myTask->taskIndex1(), myTask->taskIndex2(),
-            myTask->taskCount0(), myTask->taskCount1(), myTask->taskCount2());
+            //
+            // And now actually run the tasks
+            //
+            DBG(fprintf(stderr, "running tasks %d-%d from group %p\n", begin, end, tg));
+            lRunTaskRange(ti, begin, end, threadIndex, threadCount);
 
-        //
-        // Decrement the "number of unfinished tasks" counter in the task
-        // group.
-        //
-        lMemFence();
-        lAtomicAdd(&tg->numUnfinishedTasks, -1);
+            //
+            // Decrement the "number of unfinished tasks" counter in the task
+            // group, waking its Sync() if these were the last ones.
+            //
+            tg->unfinished.Done(end - begin);
+        }
     }
 
     pthread_exit(NULL);
@@ -740,10 +1473,11 @@ InitTaskSystem() {
         while (1) {
             if (lAtomicCompareAndSwap32(&lock, 1, 0) == 0) {
                 if (threads == NULL) {
-                    // We launch one fewer thread than there are cores,
-                    // since the main thread here will also grab jobs from
-                    // the task queue itself.
-                    nThreads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+                    // By default we launch one fewer thread than there
+                    // are cores, since the main thread here will also grab
+                    // jobs from the task queue itself.
+                    lResolveThreadConfig(PIN_NONE);
+                    nThreads = std::max(threadConfig.nThreads, 1);
 
                     int err;
                     if ((err = pthread_mutex_init(&taskSysMutex, NULL)) != 0) {
@@ -771,7 +1505,11 @@ InitTaskSystem() {
 
                     threads = (pthread_t *)malloc(nThreads * sizeof(pthread_t));
                     for (int i = 0; i < nThreads; ++i) {
-                      err = pthread_create(&threads[i], NULL, &lTaskEntry, (void *)((long long)i));
+                        pthread_attr_t attr;
+                        pthread_attr_init(&attr);
+                        lPinWorker(&attr, i);
+                        err = pthread_create(&threads[i], &attr, &lTaskEntry, (void *)((long long)i));
+                        pthread_attr_destroy(&attr);
                         if (err != 0) {
                             fprintf(stderr, "Error creating pthread %d: %s\n", i, strerror(err));
                             exit(1);
@@ -793,7 +1531,13 @@ InitTaskSystem() {
 
 
 inline void
-TaskGroup::Launch(int baseCoord, int count) {
+TaskGroup::Launch(int baseIndex, int count) {
+    //
+    // Update the count of the number of tasks left to run in this task
+    // group, before any of them can run and finish.
+    //
+    unfinished.Add(count);
+
     //
     // Acquire mutex, add task
     //
@@ -803,15 +1547,15 @@ TaskGroup::Launch(int baseCoord, int count) {
         exit(1);
     }
 
-    // Add the corresponding set of tasks to the waiting-to-be-run list for
-    // this task group.
+    // The whole launch goes on this task group's waiting list as a single
+    // range.
     //
     // FIXME: it's a little ugly to hold a global mutex for this when we
     // only need to make sure no one else is accessing this task group's
-    // waitingTasks list.  (But a small experiment in switching to a
+    // waitingRanges list.  (But a small experiment in switching to a
     // per-TaskGroup mutex showed worse performance!)
-    for (int i = 0; i < count; ++i)
-        waitingTasks.push_back(baseCoord + i);
+    WaitingRange range = { baseIndex, 0, count };
+    waitingRanges.push_back(range);
 
     // Add the task group to the global active list if it isn't there
     // already.
@@ -825,18 +1569,13 @@ TaskGroup::Launch(int baseCoord, int count) {
         exit(1);
     }
 
-    //
-    // Update the count of the number of tasks left to run in this task
-    // group.
-    //
-    lMemFence();
-    lAtomicAdd(&numUnfinishedTasks, count);
-
     //
     // Post to the worker semaphore to wake up worker threads that are
-    // sleeping waiting for tasks to show up
+    // sleeping waiting for tasks to show up; each one keeps taking tasks
+    // until there are none left, so there's no point in waking more
+    // workers than there are tasks or workers.
     //
-    for (int i = 0; i < count; ++i)
+    for (int i = 0; i < std::min(count, nThreads); ++i)
         if ((err = sem_post(workerSemaphore)) != 0) {
             fprintf(stderr, "Error from sem_post: %s\n", strerror(err));
             exit(1);
@@ -846,17 +1585,16 @@ TaskGroup::Launch(int baseCoord, int count) {
 
 inline void
 TaskGroup::Sync() {
-    DBG(fprintf(stderr, "syncing %p - %d unfinished\n", tg, numUnfinishedTasks));
+    DBG(fprintf(stderr, "syncing %p\n", this));
 
-    while (numUnfinishedTasks > 0) {
+    while (unfinished.Pending()) {
         // All of the tasks in this group aren't finished yet.  We'll try
-        // to help out here since we don't have anything else to do...
-
-        DBG(fprintf(stderr, "while syncing %p - %d unfinished\n", tg, 
-                    numUnfinishedTasks));
+        // to help out here since we don't have anything else to do,
+        // preferring our own tasks and otherwise running ones from another
+        // group to make ourselves useful.
 
         //
-        // Acquire the global task system mutex to grab a task to work on
+        // Acquire the global task system mutex to grab tasks to work on
         //
         int err;
         if ((err = pthread_mutex_lock(&taskSysMutex)) != 0) {
@@ -864,87 +1602,524 @@ TaskGroup::Sync() {
             exit(1);
         }
 
-        TaskInfo *myTask = NULL;
-        TaskGroup *runtg = this;
-        if (waitingTasks.size() > 0) {
-            int taskNumber = waitingTasks.back();
-            waitingTasks.pop_back();
-
-            if (waitingTasks.size() == 0) {
-                // There's nothing left to start running from this group,
-                // so remove it from the active task list.
-                activeTaskGroups.erase(std::find(activeTaskGroups.begin(),
-                                                 activeTaskGroups.end(), this));
-                inActiveList = false;
-            }
-            myTask = GetTaskInfo(taskNumber);
-            DBG(fprintf(stderr, "running task %d from group %p in sync\n", taskNumber, tg));
-        }
-        else {
-            // Other threads are already working on all of the tasks in
-            // this group, so we can't help out by running one ourself.
-            // We'll try to run one from another group to make ourselves
-            // useful here.
-            if (activeTaskGroups.size() == 0) {
-                // No active task groups left--there's nothing for us to do.
-                if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
-                    fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
-                    exit(1);
-                }
-                // FIXME: We basically end up busy-waiting here, which is
-                // extra wasteful in a world with hyper-threading.  It would
-                // be much better to put this thread to sleep on a
-                // condition variable that was signaled when the last task
-                // in this group was finished.
-#ifndef ISPC_IS_KNC
-                usleep(1);
-#else
-                _mm_delay_32(8);
-#endif
-                continue;
-            }
-
-            // Get a task to run from another task group.
-            runtg = activeTaskGroups.back();
-            assert(runtg->waitingTasks.size() > 0);
-
-            int taskNumber = runtg->waitingTasks.back();
-            runtg->waitingTasks.pop_back();
-            if (runtg->waitingTasks.size() == 0) {
-                // There's left to start running from this group, so remove
-                // it from the active task list.
-                activeTaskGroups.pop_back();
-                runtg->inActiveList = false;
-            }
-            myTask = runtg->GetTaskInfo(taskNumber);
-            DBG(fprintf(stderr, "running task %d from other group %p in sync\n", 
-                        taskNumber, runtg));
-        }
+        TaskGroup *runtg;
+        TaskInfo *ti;
+        int begin, end;
+        bool found = lTakeTasks(this, &runtg, &ti, &begin, &end);
 
         if ((err = pthread_mutex_unlock(&taskSysMutex)) != 0) {
             fprintf(stderr, "Error from pthread_mutex_unlock: %s\n", strerror(err));
             exit(1);
         }
+
+        if (!found) {
+            // Nothing left to help with.  The rest of our tasks are
+            // running on other threads; spin briefly in case they are
+            // about to finish, then sleep until the last one does.
+            for (int i = 0; i < WAIT_SPIN_ROUNDS && unfinished.Pending(); ++i)
+                lPause();
+            break;
+        }
     
         //
-        // Do work for _myTask_
+        // Do work for the tasks we took
         //
-        // FIXME: bogus values for thread index/thread count here as well..
-        myTask->func(myTask->data, 0, 1, myTask->taskIndex, myTask->taskCount(),
-            myTask->taskIndex0(), myTask->taskIndex1(), myTask->taskIndex2(),
-            myTask->taskCount0(), myTask->taskCount1(), myTask->taskCount2());
+        // Workers are threads 0 ... nThreads-1 and keep their index when
+        // they sync; any other thread that syncs is thread nThreads.
+        DBG(fprintf(stderr, "running tasks %d-%d from group %p in sync\n", begin, end, runtg));
+        lRunTaskRange(ti, begin, end, lWorkerIndex >= 0 ? lWorkerIndex : nThreads, nThreads + 1);
 
         //
         // Decrement the number of unfinished tasks counter
         //
-        lMemFence();
-        lAtomicAdd(&runtg->numUnfinishedTasks, -1);
+        runtg->unfinished.Done(end - begin);
     }
-    DBG(fprintf(stderr, "sync for %p done!n", tg));
+
+    unfinished.Wait();
+    DBG(fprintf(stderr, "sync for %p done!n", this));
 }
 
 #endif // ISPC_USE_PTHREADS
 
+///////////////////////////////////////////////////////////////////////////
+// pthreads with work stealing
+
+#ifdef ISPC_USE_PTHREADS_WORK_STEALING
+
+#define LOG_DEQUE_INITIAL_SIZE 10
+
+/* Threads that are not workers get one of these deques the first time
+   they launch, and give it back when they exit; while all are taken,
+   launches from other threads run inline. */
+#define MAX_EXTERNAL_THREADS 8
+
+/* Rounds of looking for work an idle worker makes before it parks. */
+#define IDLE_SPIN_ROUNDS 64
+
+/* Launches are split down to ranges of about count / (TASK_GRAIN_SPLITS *
+   threads) tasks, enough pieces to balance uneven tasks without paying
+   for a steal per task. */
+#define TASK_GRAIN_SPLITS 8
+
+/* Tasks [begin, end) of the launch described by `info`. */
+struct WorkItem {
+    TaskInfo *info;
+    int begin;
+    int end;
+};
+
+/* Chase-Lev work-stealing deque ("Dynamic Circular Work-Stealing Deque",
+   Chase and Lev 2005, with the C11 orderings of Le et al. 2013).  Only the
+   owning thread pushes and pops at the bottom; any thread may steal from
+   the top.  Arrays replaced when the deque grows are kept until exit,
+   since a thief may still be reading from one.
+ */
+class WorkDeque {
+public:
+    WorkDeque() : top(0), bottom(0), array(new Array(LOG_DEQUE_INITIAL_SIZE)) {}
+
+    void Push(const WorkItem &item);
+    bool Pop(WorkItem *item);
+    bool Steal(WorkItem *item);
+    bool Empty() const {
+        return bottom.load(std::memory_order_seq_cst) <= top.load(std::memory_order_seq_cst);
+    }
+
+private:
+    /* An item is two words; a thief that reads a torn one loses the race
+       for `top` and drops it. */
+    struct Array {
+        int64_t mask;
+        std::atomic<TaskInfo *> *infos;
+        std::atomic<int64_t> *ranges;
+
+        Array(int logSize) : mask((int64_t(1) << logSize) - 1),
+                             infos(new std::atomic<TaskInfo *>[int64_t(1) << logSize]),
+                             ranges(new std::atomic<int64_t>[int64_t(1) << logSize]) {}
+
+        WorkItem Get(int64_t i) const {
+            int64_t range = ranges[i & mask].load(std::memory_order_relaxed);
+            WorkItem item = { infos[i & mask].load(std::memory_order_relaxed),
+                              (int)(range >> 32), (int)(uint32_t)range };
+            return item;
+        }
+        void Put(int64_t i, const WorkItem &item) {
+            infos[i & mask].store(item.info, std::memory_order_relaxed);
+            ranges[i & mask].store(((int64_t)item.begin << 32) | (uint32_t)item.end,
+                                   std::memory_order_relaxed);
+        }
+    };
+
+    alignas(64) std::atomic<int64_t> top;
+    alignas(64) std::atomic<int64_t> bottom;
+    std::atomic<Array *> array;
+    std::vector<Array *> retired;
+};
+
+
+inline void
+WorkDeque::Push(const WorkItem &item) {
+    int64_t b = bottom.load(std::memory_order_relaxed);
+    int64_t t = top.load(std::memory_order_acquire);
+    Array *a = array.load(std::memory_order_relaxed);
+
+    if (b - t > a->mask) {
+        int logSize = 1;
+        while ((int64_t(1) << logSize) <= a->mask + 1)
+            ++logSize;
+
+        Array *grown = new Array(logSize);
+        for (int64_t i = t; i < b; ++i)
+            grown->Put(i, a->Get(i));
+        retired.push_back(a);
+        array.store(grown, std::memory_order_release);
+        a = grown;
+    }
+
+    a->Put(b, item);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom.store(b + 1, std::memory_order_relaxed);
+}
+
+
+inline bool
+WorkDeque::Pop(WorkItem *item) {
+    int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+    Array *a = array.load(std::memory_order_relaxed);
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+        // Empty
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    *item = a->Get(b);
+    if (t == b) {
+        // Last item, race thieves for it
+        bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                               std::memory_order_relaxed);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return won;
+    }
+    return true;
+}
+
+
+inline bool
+WorkDeque::Steal(WorkItem *item) {
+    int64_t t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom.load(std::memory_order_acquire);
+
+    if (t >= b)
+        return false;
+
+    Array *a = array.load(std::memory_order_acquire);
+    *item = a->Get(t);
+    return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                       std::memory_order_relaxed);
+}
+
+
+static volatile int32_t lock = 0;
+
+/* deques[0 ... nWorkers) belong to the worker threads, the remaining
+   MAX_EXTERNAL_THREADS to other threads that launch tasks, claimed through
+   externalUsed and released by externalKey's destructor when the thread
+   exits.  Only deques below nWorkers + nExternalActive have ever been
+   claimed, so only those are searched for work.
+
+   Tasks get the index of the deque of the thread running them, or nSlots
+   on a thread without one; such threads take turns running their tasks
+   under inlineMutex, so indices stay unique among running tasks. */
+#define SLOT_UNCLAIMED -1
+#define SLOT_NONE -2
+
+static int nWorkers;
+static int nSlots;
+static WorkDeque *deques = NULL;
+static pthread_t *threads = NULL;
+static std::atomic<bool> externalUsed[MAX_EXTERNAL_THREADS];
+static std::atomic<int> nExternalActive(0);
+static pthread_key_t externalKey;
+static pthread_mutex_t inlineMutex;
+static __thread int lSlot = SLOT_UNCLAIMED;
+
+/* The workers pinned to each NUMA node; empty unless workers are pinned. */
+static std::vector<std::vector<int> > nodeWorkers;
+
+static void
+lGroupWorkersByNode() {
+    nodeWorkers.resize(threadConfig.nNodes);
+    for (int i = 0; i < nWorkers; ++i)
+        if (lWorkerNode(i) >= 0)
+            nodeWorkers[lWorkerNode(i)].push_back(i);
+}
+
+/* Idle workers sleep on parkCond until wakeEpoch changes. */
+static pthread_mutex_t parkMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t parkCond = PTHREAD_COND_INITIALIZER;
+static std::atomic<int> nParked(0);
+static std::atomic<uint32_t> wakeEpoch(0);
+
+static inline uint32_t
+lRandom(uint32_t *state) {
+    // xorshift32
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+
+static void lWake(int count);
+
+/* Runs the tasks of `item`.  While the range is larger than the launch's
+   grain size, the upper half goes back on our deque for others to steal,
+   so a launch is split up only as far as there are threads to take it. */
+static void
+lRunItem(WorkItem item, int slot) {
+    TaskInfo *ti = item.info;
+    int grain = std::max(1, ti->taskCount() / (TASK_GRAIN_SPLITS * (nWorkers + 1)));
+
+    if (slot >= 0) {
+        while (item.end - item.begin > grain) {
+            int mid = item.begin + (item.end - item.begin) / 2;
+            WorkItem upper = { ti, mid, item.end };
+            deques[slot].Push(upper);
+            lWake(1);
+            item.end = mid;
+        }
+    }
+
+    DBG(fprintf(stderr, "running tasks %d-%d from group %p\n", item.begin, item.end, ti->group));
+    if (slot >= 0)
+        lRunTaskRange(ti, item.begin, item.end, slot, nSlots + 1);
+    else {
+        pthread_mutex_lock(&inlineMutex);
+        lRunTaskRange(ti, item.begin, item.end, nSlots, nSlots + 1);
+        pthread_mutex_unlock(&inlineMutex);
+    }
+
+    ti->group->unfinished.Done(item.end - item.begin);
+}
+
+
+/* Pops from our own deque, or steals from the others starting at a random
+   victim.  Pinned workers first try the workers on their own NUMA node,
+   so a launch split up on one node tends to stay there, along with the
+   cache lines and pages its tasks touch. */
+static bool
+lFindWork(int slot, uint32_t *seed, WorkItem *item) {
+    if (deques[slot].Pop(item))
+        return true;
+
+    int node = slot < nWorkers ? lWorkerNode(slot) : -1;
+    if (node >= 0 && nodeWorkers[node].size() > 1) {
+        const std::vector<int> &near = nodeWorkers[node];
+        int start = lRandom(seed) % near.size();
+        for (size_t i = 0; i < near.size(); ++i) {
+            int victim = near[(start + i) % near.size()];
+            if (victim != slot && deques[victim].Steal(item)) {
+                lTraceInstant(TRACE_STEAL, NULL, victim);
+                return true;
+            }
+        }
+    }
+
+    int active = nWorkers + nExternalActive.load(std::memory_order_acquire);
+    int start = lRandom(seed) % active;
+    for (int i = 0; i < active; ++i) {
+        int victim = (start + i) % active;
+        if (victim == slot)
+            continue;
+        if (deques[victim].Steal(item)) {
+            lTraceInstant(TRACE_STEAL, NULL, victim);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool
+lAnyWork() {
+    int active = nWorkers + nExternalActive.load(std::memory_order_acquire);
+    for (int i = 0; i < active; ++i)
+        if (!deques[i].Empty())
+            return true;
+    return false;
+}
+
+
+/* Puts the calling worker to sleep until the next wakeup.  Registering as
+   parked before the final look for work pairs with the fence in lWake(),
+   so a launch either sees the worker parked or is seen by it. */
+static void
+lPark() {
+    nParked.fetch_add(1, std::memory_order_seq_cst);
+    uint32_t epoch = wakeEpoch.load(std::memory_order_seq_cst);
+
+    if (!lAnyWork()) {
+        pthread_mutex_lock(&parkMutex);
+        while (wakeEpoch.load(std::memory_order_relaxed) == epoch)
+            pthread_cond_wait(&parkCond, &parkMutex);
+        pthread_mutex_unlock(&parkMutex);
+    }
+
+    nParked.fetch_sub(1, std::memory_order_relaxed);
+}
+
+
+/* Wakes up to `count` parked workers, with a single broadcast when that
+   is all of them.  Free when nobody is parked. */
+static void
+lWake(int count) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int parked = nParked.load(std::memory_order_seq_cst);
+    if (parked == 0)
+        return;
+
+    pthread_mutex_lock(&parkMutex);
+    wakeEpoch.fetch_add(1, std::memory_order_relaxed);
+    if (count >= parked)
+        pthread_cond_broadcast(&parkCond);
+    else
+        for (int i = 0; i < count; ++i)
+            pthread_cond_signal(&parkCond);
+    pthread_mutex_unlock(&parkMutex);
+}
+
+
+/* externalKey's destructor: frees the exiting thread's deque for the next
+   thread that launches.  Its launches have all been synced, so the deque
+   is empty. */
+static void
+lReleaseExternalSlot(void *value) {
+    int external = (int)(intptr_t)value - 1;
+    externalUsed[external].store(false, std::memory_order_release);
+}
+
+
+static void *
+lWorkerEntry(void *arg) {
+    int slot = (int)((int64_t)arg);
+    uint32_t seed = 2654435761u * (slot + 1);
+    lSlot = slot;
+
+    while (1) {
+        WorkItem item;
+        bool found = false;
+        for (int i = 0; i < IDLE_SPIN_ROUNDS && !found; ++i) {
+            if (i > 0)
+                lPause();
+            found = lFindWork(slot, &seed, &item);
+        }
+
+        if (!found) {
+            uint64_t idleStart = lTraceBegin();
+            lPark();
+            lTraceEnd(TRACE_IDLE, idleStart);
+            continue;
+        }
+
+        lRunItem(item, slot);
+    }
+
+    pthread_exit(NULL);
+    return 0;
+}
+
+
+static void
+InitTaskSystem() {
+    if (threads == NULL) {
+        while (1) {
+            if (lAtomicCompareAndSwap32(&lock, 1, 0) == 0) {
+                if (threads == NULL) {
+                    // The launching thread helps out in Sync(), so by
+                    // default one fewer worker than there are cores.
+                    lResolveThreadConfig(PIN_NONE);
+                    nWorkers = std::max(threadConfig.nThreads, 1);
+                    nSlots = nWorkers + MAX_EXTERNAL_THREADS;
+                    deques = new WorkDeque[nSlots];
+                    lGroupWorkersByNode();
+                    pthread_key_create(&externalKey, lReleaseExternalSlot);
+
+                    // Tasks run inline may launch and run more inline
+                    pthread_mutexattr_t mutexAttr;
+                    pthread_mutexattr_init(&mutexAttr);
+                    pthread_mutexattr_settype(&mutexAttr, PTHREAD_MUTEX_RECURSIVE);
+                    pthread_mutex_init(&inlineMutex, &mutexAttr);
+                    pthread_mutexattr_destroy(&mutexAttr);
+
+                    pthread_t *workers = (pthread_t *)malloc(nWorkers * sizeof(pthread_t));
+                    for (int i = 0; i < nWorkers; ++i) {
+                        pthread_attr_t attr;
+                        pthread_attr_init(&attr);
+                        lPinWorker(&attr, i);
+                        int err = pthread_create(&workers[i], &attr, &lWorkerEntry, (void *)((long long)i));
+                        pthread_attr_destroy(&attr);
+                        if (err != 0) {
+                            fprintf(stderr, "Error creating pthread %d: %s\n", i, strerror(err));
+                            exit(1);
+                        }
+                    }
+
+                    lMemFence();
+                    threads = workers;
+                }
+
+                // Make sure all of the above goes to memory before we
+                // clear the lock.
+                lMemFence();
+                lock = 0;
+                break;
+            }
+        }
+    }
+}
+
+
+/* The deque slot of the calling thread, claiming a free one for a
+   non-worker thread on first use; SLOT_NONE if there was none left then,
+   which is remembered so later launches don't search again. */
+static inline int
+lThreadSlot() {
+    if (lSlot != SLOT_UNCLAIMED)
+        return lSlot;
+
+    lSlot = SLOT_NONE;
+    for (int i = 0; i < MAX_EXTERNAL_THREADS; ++i) {
+        bool expected = false;
+        if (externalUsed[i].load(std::memory_order_relaxed) ||
+            !externalUsed[i].compare_exchange_strong(expected, true, std::memory_order_acquire))
+            continue;
+
+        int active = nExternalActive.load(std::memory_order_relaxed);
+        while (active < i + 1 &&
+               !nExternalActive.compare_exchange_weak(active, i + 1, std::memory_order_release))
+            ;
+        lSlot = nWorkers + i;
+        pthread_setspecific(externalKey, (void *)(intptr_t)(i + 1));
+        break;
+    }
+    return lSlot;
+}
+
+
+inline void
+TaskGroup::Launch(int baseIndex, int count) {
+    TaskInfo *ti = GetTaskInfo(baseIndex);
+    ti->group = this;
+
+    unfinished.Add(count);
+
+    WorkItem item = { ti, 0, count };
+    int slot = lThreadSlot();
+    if (slot < 0) {
+        // Out of deques; run the tasks here.
+        lRunItem(item, slot);
+        return;
+    }
+
+    // The whole launch is one item; it is split as it is taken
+    deques[slot].Push(item);
+    lWake(1);
+}
+
+
+inline void
+TaskGroup::Sync() {
+    int slot = lThreadSlot();
+    uint32_t seed = 2654435761u * (slot + 2);
+
+    DBG(fprintf(stderr, "syncing %p\n", this));
+
+    while (unfinished.Pending()) {
+        // Help out with whatever is runnable, our own tasks first.
+        WorkItem item;
+        if (slot < 0 || !lFindWork(slot, &seed, &item)) {
+            // Everything left in the group is already running elsewhere;
+            // spin briefly, then sleep until the last task finishes.
+            for (int i = 0; i < WAIT_SPIN_ROUNDS && unfinished.Pending(); ++i)
+                lPause();
+            break;
+        }
+
+        lRunItem(item, slot);
+    }
+
+    unfinished.Wait();
+    DBG(fprintf(stderr, "sync for %p done!n", this));
+}
+
+#endif // ISPC_USE_PTHREADS_WORK_STEALING
+
 ///////////////////////////////////////////////////////////////////////////
 // Cilk Plus
 
@@ -1103,8 +2278,6 @@ TaskGroup::Sync() {
 #endif
 ///////////////////////////////////////////////////////////////////////////
 
-#ifndef ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
-
 #define MAX_FREE_TASK_GROUPS 64
 static TaskGroup *freeTaskGroups[MAX_FREE_TASK_GROUPS];
 
@@ -1141,6 +2314,8 @@ FreeTaskGroup(TaskGroup *tg) {
 
 ///////////////////////////////////////////////////////////////////////////
 
+#ifndef ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+
 void
 ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count0, int count1, int count2) {
     const int count = count0*count1*count2;
@@ -1153,6 +2328,20 @@ ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count0, int count1,
     else
         taskGroup = (TaskGroup *)(*taskGroupPtr);
 
+    if (count <= 0)
+        return;
+
+#ifdef ISPC_RANGE_LAUNCHES
+    // A single TaskInfo describes the whole launch
+    int baseIndex = taskGroup->AllocTaskInfo(1);
+    TaskInfo *ti = taskGroup->GetTaskInfo(baseIndex);
+    ti->func = (TaskFuncType)func;
+    ti->data = data;
+    ti->taskIndex = 0;
+    ti->taskCount3d[0] = count0;
+    ti->taskCount3d[1] = count1;
+    ti->taskCount3d[2] = count2;
+#else
     int baseIndex = taskGroup->AllocTaskInfo(count);
     for (int i = 0; i < count; ++i) {
         TaskInfo *ti = taskGroup->GetTaskInfo(baseIndex+i);
@@ -1163,6 +2352,8 @@ ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count0, int count1,
         ti->taskCount3d[1] = count1;
         ti->taskCount3d[2] = count2;
     }
+#endif
+    lTraceInstant(TRACE_LAUNCH, func, 0, count);
     taskGroup->Launch(baseIndex, count);
 }
 
@@ -1171,7 +2362,9 @@ void
 ISPCSync(void *h) {
     TaskGroup *taskGroup = (TaskGroup *)h;
     if (taskGroup != NULL) {
+        uint64_t syncStart = lTraceBegin();
         taskGroup->Sync();
+        lTraceEnd(TRACE_SYNC, syncStart);
         FreeTaskGroup(taskGroup);
     }
 }
@@ -1196,16 +2389,22 @@ ISPCAlloc(void **taskGroupPtr, int64_t size, int32_t alignment) {
 #define MAX_LIVE_TASKS 1024
 
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t workCond = PTHREAD_COND_INITIALIZER; // a live task became active
+pthread_cond_t liveCond = PTHREAD_COND_INITIALIZER; // a live task lost its last lock
 
-// Small structure used to hold the data for each task
+/* Index of the calling thread among the workers, -1 for other threads. */
+static __thread int lWorkerIndex = -1;
+
+// Small structure used to hold the data for each launch
 struct Task {
 public:
     TaskFuncType func;
     void *data;
-    volatile int32_t taskIndex;
+    volatile int32_t taskIndex; // next task to hand out
     int taskCount;
+    int taskCount3d[3];
 
-    volatile int numDone;
+    SyncCounter unfinished;
     int liveIndex; // index in live task queue
 
     inline int  noMoreWork() { return taskIndex >= taskCount; }
@@ -1214,22 +2413,18 @@ public:
     // inline void unlock() { lAtomicAdd(&locks,-1); }
     inline int  nextJob() { return lAtomicAdd(&taskIndex,1); }
     inline int  numJobs() { return taskCount; }
-    inline void schedule(int idx) { taskIndex = 0; numDone = 0; liveIndex = idx; }
-    inline void run(int idx, int threadIdx);
-    inline void markOneDone() { lAtomicAdd(&numDone,1); }
+    inline void schedule(int idx) { taskIndex = 0; unfinished.Reset(); unfinished.Add(taskCount); liveIndex = idx; }
+    inline void run(int idx);
+    inline void markOneDone() { unfinished.Done(); }
     inline void wait()
     {
         while (!noMoreWork()) {
             int next = nextJob();
-            if (next < numJobs()) run(next, 0);
-        }
-        while (numDone != taskCount) {
-#ifndef ISPC_IS_KNC
-            usleep(1);
-#else
-            _mm_delay_32(8);
-#endif
+            if (next < numJobs()) run(next);
         }
+        for (int i = 0; i < WAIT_SPIN_ROUNDS && unfinished.Pending(); ++i)
+            lPause();
+        unfinished.Wait();
     }
 };
 
@@ -1247,13 +2442,22 @@ class TaskSys {
                                  becomes active */
         Task *task;
 
-        inline void doneWithThis() { lAtomicAdd(&locks,-1); }
-        LiveTask() : active(0), locks(-1) {}
+        inline void doneWithThis()
+        {
+            // Only the creator is left, wake it up if it's waiting in sync()
+            if (__sync_sub_and_fetch(&locks, 1) == 1) {
+                pthread_mutex_lock(&mutex);
+                pthread_cond_broadcast(&liveCond);
+                pthread_mutex_unlock(&mutex);
+            }
+        }
+        LiveTask() : locks(-1), active(0) {}
     };
 
 public:
     volatile int nextScheduleIndex; /*! next index in the task queue
                                         where we'll insert a live task */
+    int numSleeping; /*! workers waiting on workCond, protected by mutex */
 
     // inline int inc_begin() { int old = begin; begin = (begin+1)%MAX_TASKS; return old; }
     // inline int inc_end() { int old = end; end = (end+1)%MAX_TASKS; return old; }
@@ -1263,7 +2467,7 @@ public:
 
     static TaskSys *global;
 
-    TaskSys() : nextScheduleIndex(0)
+    TaskSys() : nextScheduleIndex(0), numSleeping(0)
     {
         TaskSys::global = this;
         Task *mem = new Task[MAX_LIVE_TASKS]; //< could actually be more than _live_ tasks
@@ -1315,6 +2519,8 @@ public:
         t->schedule(liveIndex);
         taskQueue[liveIndex].locks = numThreadsRunning+1; // num _worker_ threads plus creator
         taskQueue[liveIndex].active = true;
+        if (numSleeping > 0)
+            pthread_cond_broadcast(&workCond);
         pthread_mutex_unlock(&mutex);
     }
 
@@ -1322,14 +2528,14 @@ public:
     {
         task->wait();
         int liveIndex = task->liveIndex;
-        while (taskQueue[liveIndex].locks > 1) {
-#ifndef ISPC_IS_KNC
-            usleep(1);
-#else
-            _mm_delay_32(8);
-#endif
+        for (int i = 0; i < WAIT_SPIN_ROUNDS && taskQueue[liveIndex].locks > 1; ++i)
+            lPause();
+        if (taskQueue[liveIndex].locks > 1) {
+            pthread_mutex_lock(&mutex);
+            while (taskQueue[liveIndex].locks > 1)
+                pthread_cond_wait(&liveCond, &mutex);
+            pthread_mutex_unlock(&mutex);
         }
-        _mm_free(task->data);
         pthread_mutex_lock(&mutex);
         taskMem.push(task); // recycle task index
         taskQueue[liveIndex].active = false;
@@ -1342,20 +2548,25 @@ void TaskSys::threadFct()
 {
     int myIndex = 0; //lAtomicAdd(&threadIdx,1);
     while (1) {
-        while (!taskQueue[myIndex].active) {
-#ifndef ISPC_IS_KNC
-            usleep(4);
-#else
-            _mm_delay_32(32);
-#endif
-            continue;
+        for (int i = 0; i < WAIT_SPIN_ROUNDS && !taskQueue[myIndex].active; ++i)
+            lPause();
+        if (!taskQueue[myIndex].active) {
+            // Nothing scheduled, sleep until schedule() wakes us
+            uint64_t idleStart = lTraceBegin();
+            pthread_mutex_lock(&mutex);
+            ++numSleeping;
+            while (!taskQueue[myIndex].active)
+                pthread_cond_wait(&workCond, &mutex);
+            --numSleeping;
+            pthread_mutex_unlock(&mutex);
+            lTraceEnd(TRACE_IDLE, idleStart);
         }
 
         Task *mine = taskQueue[myIndex].task;
         while (!mine->noMoreWork()) {
             int job = mine->nextJob();
             if (job >= mine->numJobs()) break;
-            mine->run(job,myIndex);
+            mine->run(job);
         }
         taskQueue[myIndex].doneWithThis();
         myIndex = (myIndex+1)%MAX_LIVE_TASKS;
@@ -1363,14 +2574,24 @@ void TaskSys::threadFct()
 }
 
 
-inline void Task::run(int idx, int threadIdx) {
-    (*this->func)(data,threadIdx,TaskSys::global->nThreads,idx,taskCount);
+/* Workers are threads 0 ... nThreads-1; whichever other thread helps out
+   while it syncs is thread nThreads. */
+inline void Task::run(int idx) {
+    int threadCount = TaskSys::global->nThreads + 1;
+    int threadIdx = lWorkerIndex >= 0 ? lWorkerIndex : threadCount - 1;
+    uint64_t taskStart = lTraceBegin();
+    (*this->func)(data, threadIdx, threadCount, idx, taskCount,
+                  idx % taskCount3d[0], (idx / taskCount3d[0]) % taskCount3d[1],
+                  idx / (taskCount3d[0] * taskCount3d[1]),
+                  taskCount3d[0], taskCount3d[1], taskCount3d[2]);
+    lTraceEnd(TRACE_TASKS, taskStart, (const void *)func, idx, idx + 1);
     markOneDone();
 }
 
 
 void *_threadFct(void *data) {
-    ((TaskSys*)data)->threadFct();
+    lWorkerIndex = (int)((int64_t)data);
+    TaskSys::global->threadFct();
     return NULL;
 }
 
@@ -1378,9 +2599,10 @@ void *_threadFct(void *data) {
 void TaskSys::createThreads() 
 {
     init();
-    int reserved = 4;
-    int minid = 2;
-    nThreads = sysconf(_SC_NPROCESSORS_ONLN) - reserved;
+    // One thread per allowed CPU, less the one that launches, each pinned
+    // to its own unless ISPC_PIN says otherwise
+    lResolveThreadConfig(PIN_COMPACT);
+    nThreads = std::max(threadConfig.nThreads, 1);
 
     thread = (pthread_t *)malloc(nThreads * sizeof(pthread_t));
 
@@ -1390,13 +2612,10 @@ void TaskSys::createThreads()
         pthread_attr_init(&attr);
         pthread_attr_setstacksize(&attr, 2*1024 * 1024);
 
-        int threadID = minid+i;
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        CPU_SET(threadID,&cpuset);
-        int ret = pthread_attr_setaffinity_np(&attr,sizeof(cpuset),&cpuset);
+        lPinWorker(&attr, i);
 
-        int err = pthread_create(&thread[i], &attr, &_threadFct, this);
+        int err = pthread_create(&thread[i], &attr, &_threadFct, (void *)((long long)i));
+        pthread_attr_destroy(&attr);
         ++numThreadsRunning;
         if (err != 0) {
             fprintf(stderr, "Error creating pthread %d: %s\n", i, strerror(err));
@@ -1410,30 +2629,349 @@ int TaskSys::numThreadsRunning = 0;
 
 ///////////////////////////////////////////////////////////////////////////
 
-void ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count) 
+void ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count0, int count1, int count2)
 {
-    Task *ti = *(Task**)taskGroupPtr;
+    const int count = count0*count1*count2;
+    TaskGroup *taskGroup;
+    if (*taskGroupPtr == NULL) {
+        TaskSys::init();
+        taskGroup = AllocTaskGroup();
+        *taskGroupPtr = taskGroup;
+    }
+    else
+        taskGroup = (TaskGroup *)(*taskGroupPtr);
+
+    if (count <= 0)
+        return;
+
+    Task *ti = TaskSys::global->allocOne();
     ti->func = (TaskFuncType)func;
     ti->data = data;
     ti->taskIndex = 0;
     ti->taskCount = count;
+    ti->taskCount3d[0] = count0;
+    ti->taskCount3d[1] = count1;
+    ti->taskCount3d[2] = count2;
+    taskGroup->launches.push_back(ti);
+    lTraceInstant(TRACE_LAUNCH, func, 0, count);
     TaskSys::global->schedule(ti);
 }
 
 void ISPCSync(void *h) 
 {
-    Task *task = (Task *)h; 
-    assert(task);
-    TaskSys::global->sync(task);
+    TaskGroup *taskGroup = (TaskGroup *)h;
+    assert(taskGroup);
+    uint64_t syncStart = lTraceBegin();
+    for (size_t i = 0; i < taskGroup->launches.size(); ++i)
+        TaskSys::global->sync(taskGroup->launches[i]);
+    lTraceEnd(TRACE_SYNC, syncStart);
+    FreeTaskGroup(taskGroup);
 }
 
 void *ISPCAlloc(void **taskGroupPtr, int64_t size, int32_t alignment) 
 {
-    TaskSys::init();
-    Task *task = TaskSys::global->allocOne();
-    *taskGroupPtr = task;
-    task->data = _mm_malloc(size,alignment);
-    return task->data;//*taskGroupPtr;
+    TaskGroup *taskGroup;
+    if (*taskGroupPtr == NULL) {
+        TaskSys::init();
+        taskGroup = AllocTaskGroup();
+        *taskGroupPtr = taskGroup;
+    }
+    else
+        taskGroup = (TaskGroup *)(*taskGroupPtr);
+
+    return taskGroup->AllocMemory(size, alignment);
 }
 
 #endif // ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+
+///////////////////////////////////////////////////////////////////////////
+// Task graphs
+
+/* Graphs run on top of the task system rather than inside each backend:
+   every node is an ordinary launch of its tasks, issued by the thread that
+   finishes the last task of the node's last dependency, so the next stage
+   starts on whichever cores are free while stragglers of the previous one
+   still run.  Nothing waits for work to show up; ISPCGraphRun() launches
+   the nodes without dependencies and then syncs every node in dependency
+   order, which helps out with whatever is left like any other sync.  Since
+   only that thread ever syncs, backends without nested syncs, such as
+   ISPC_USE_PTHREADS_FULLY_SUBSCRIBED, run graphs too. */
+
+struct TaskGraph;
+
+struct GraphNode {
+    TaskGraph *graph;
+    ISPCGraphTaskFunc func;
+    void *data;
+    int count;
+    int nDependencies;
+    std::vector<int> dependents;
+
+    void *handle;                 // the launch, once the node is ready
+    volatile int32_t pending;     // dependencies not finished yet
+    volatile int32_t unfinished;  // tasks not finished yet
+};
+
+struct TaskGraph {
+    std::vector<GraphNode> nodes;
+    std::vector<int> order;       // nodes in dependency order
+};
+
+
+static void lGraphFinishNode(GraphNode *node);
+
+static void
+lGraphTask(void *data, int threadIndex, int threadCount,
+           int taskIndex, int taskCount,
+           int taskIndex0, int taskIndex1, int taskIndex2,
+           int taskCount0, int taskCount1, int taskCount2) {
+    (void)taskIndex0; (void)taskIndex1; (void)taskIndex2;
+    (void)taskCount0; (void)taskCount1; (void)taskCount2;
+    GraphNode *node = (GraphNode *)data;
+    node->func(node->data, threadIndex, threadCount, taskIndex, taskCount);
+    if (lAtomicAdd(&node->unfinished, -1) == 1)
+        lGraphFinishNode(node);
+}
+
+
+/* Launches the tasks of a node whose dependencies have all finished.  This
+   happens before the task that finished the last of them returns, so the
+   node's handle is set by the time ISPCGraphRun() has synced them. */
+static void
+lGraphReady(GraphNode *node) {
+    if (node->count == 0) {
+        lGraphFinishNode(node);
+        return;
+    }
+
+    ISPCLaunch(&node->handle, (void *)lGraphTask, node, node->count, 1, 1);
+}
+
+
+static void
+lGraphFinishNode(GraphNode *node) {
+    TaskGraph *graph = node->graph;
+    for (size_t i = 0; i < node->dependents.size(); ++i) {
+        GraphNode *dependent = &graph->nodes[node->dependents[i]];
+        if (lAtomicAdd(&dependent->pending, -1) == 1)
+            lGraphReady(dependent);
+    }
+}
+
+
+void *
+ISPCGraphCreate() {
+    return new TaskGraph;
+}
+
+
+int
+ISPCGraphAddNode(void *g, ISPCGraphTaskFunc func, void *data, int count) {
+    TaskGraph *graph = (TaskGraph *)g;
+    GraphNode node;
+    node.graph = graph;
+    node.func = func;
+    node.data = data;
+    node.count = std::max(count, 0);
+    node.nDependencies = 0;
+    node.handle = NULL;
+    node.pending = node.unfinished = 0;
+    graph->nodes.push_back(node);
+    graph->order.clear();
+    return (int)graph->nodes.size() - 1;
+}
+
+
+void
+ISPCGraphAddDependency(void *g, int node, int dependency) {
+    TaskGraph *graph = (TaskGraph *)g;
+    assert(node >= 0 && node < (int)graph->nodes.size());
+    assert(dependency >= 0 && dependency < (int)graph->nodes.size());
+    graph->nodes[dependency].dependents.push_back(node);
+    ++graph->nodes[node].nDependencies;
+    graph->order.clear();
+}
+
+
+int
+ISPCGraphRun(void *g) {
+    TaskGraph *graph = (TaskGraph *)g;
+    int nNodes = (int)graph->nodes.size();
+    if (nNodes == 0)
+        return 1;
+
+    // Sort the nodes once per shape of the graph.  A node on a cycle would
+    // never get launched, so the graph can't run at all
+    if ((int)graph->order.size() != nNodes) {
+        std::vector<int> &order = graph->order;
+        std::vector<int> pending(nNodes);
+        order.clear();
+        for (int i = 0; i < nNodes; ++i)
+            if ((pending[i] = graph->nodes[i].nDependencies) == 0)
+                order.push_back(i);
+        for (size_t i = 0; i < order.size(); ++i) {
+            const std::vector<int> &dependents = graph->nodes[order[i]].dependents;
+            for (size_t j = 0; j < dependents.size(); ++j)
+                if (--pending[dependents[j]] == 0)
+                    order.push_back(dependents[j]);
+        }
+        if ((int)order.size() != nNodes) {
+            order.clear();
+            return 0;
+        }
+    }
+
+    for (int i = 0; i < nNodes; ++i) {
+        GraphNode &node = graph->nodes[i];
+        node.handle = NULL;
+        node.pending = node.nDependencies;
+        node.unfinished = node.count;
+    }
+    lMemFence();
+
+    for (int i = 0; i < nNodes; ++i)
+        if (graph->nodes[i].nDependencies == 0)
+            lGraphReady(&graph->nodes[i]);
+
+    // By the time a node comes up, everything it depends on has been
+    // synced, so it has been launched unless it has no tasks
+    for (int i = 0; i < nNodes; ++i) {
+        GraphNode &node = graph->nodes[graph->order[i]];
+        if (node.handle != NULL)
+            ISPCSync(node.handle);
+    }
+    return 1;
+}
+
+
+void
+ISPCGraphDestroy(void *g) {
+    delete (TaskGraph *)g;
+}
+
+///////////////////////////////////////////////////////////////////////////
+// Trace output
+
+#ifdef ISPC_TASK_TRACE
+
+static void
+lTraceFuncName(const void *func, char *name, int size) {
+#if defined(ISPC_IS_LINUX) || defined(ISPC_IS_APPLE)
+    Dl_info info;
+    if (dladdr(func, &info) != 0 && info.dli_fname != NULL) {
+        if (info.dli_sname != NULL && info.dli_saddr == func)
+            snprintf(name, size, "%s", info.dli_sname);
+        else {
+            const char *module = strrchr(info.dli_fname, '/');
+            snprintf(name, size, "%s+0x%llx", module != NULL ? module + 1 : info.dli_fname,
+                     (unsigned long long)((const char *)func - (const char *)info.dli_fbase));
+        }
+        return;
+    }
+#endif
+    snprintf(name, size, "%p", func);
+}
+
+
+void
+ISPCTraceEnable(int enable) {
+    if (enable && traceStart == 0)
+        traceStart = lTraceNow();
+    lMemFence();
+    traceEnabled = enable != 0;
+}
+
+
+int
+ISPCTraceDump(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error opening trace file %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+
+    static const char *names[] = { "tasks", "launch", "sync", "idle", "steal" };
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    int nThreads = std::min((int)nTraceBuffers, MAX_TRACE_THREADS);
+    bool first = true;
+    for (int t = 0; t < nThreads; ++t) {
+        TraceBuffer *buffer = traceBuffers[t];
+        if (buffer == NULL)
+            continue;
+
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"thread %d\"}}", first ? "" : ",\n", t, t);
+        first = false;
+
+        int64_t end = buffer->next;
+        int64_t begin = std::max(end - TRACE_RING_SIZE, (int64_t)0);
+        for (int64_t i = begin; i < end; ++i) {
+            const TraceEvent &event = buffer->events[i & (TRACE_RING_SIZE - 1)];
+            if (event.start < traceStart)
+                continue;
+
+            char name[256];
+            if (event.func != NULL)
+                lTraceFuncName(event.func, name, sizeof(name));
+            else
+                snprintf(name, sizeof(name), "%s", names[event.type]);
+
+            double ts = (event.start - traceStart) / 1000.0;
+            if (event.type == TRACE_LAUNCH || event.type == TRACE_STEAL)
+                fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,"
+                        "\"pid\":1,\"tid\":%d,\"args\":{\"%s\":%d}}",
+                        name, names[event.type], ts, t,
+                        event.type == TRACE_LAUNCH ? "count" : "victim",
+                        event.type == TRACE_LAUNCH ? event.b : event.a);
+            else if (event.type == TRACE_TASKS)
+                fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"tasks\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":1,\"tid\":%d,\"args\":{\"begin\":%d,\"end\":%d}}",
+                        name, ts, (event.end - event.start) / 1000.0, t, event.a, event.b);
+            else
+                fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":1,\"tid\":%d}",
+                        name, names[event.type], ts, (event.end - event.start) / 1000.0, t);
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    bool ok = ferror(f) == 0;
+    ok = fclose(f) == 0 && ok;
+    if (!ok)
+        fprintf(stderr, "Error writing trace file %s\n", path);
+    return ok;
+}
+
+
+static const char *tracePath = NULL;
+
+static void
+lTraceDumpAtExit() {
+    ISPCTraceDump(tracePath);
+}
+
+/* ISPC_TRACE=file traces the whole run. */
+static struct TraceFromEnvironment {
+    TraceFromEnvironment() {
+        tracePath = getenv("ISPC_TRACE");
+        if (tracePath != NULL && *tracePath != '\0') {
+            ISPCTraceEnable(1);
+            atexit(lTraceDumpAtExit);
+        }
+    }
+} traceFromEnvironment;
+
+#else
+
+void
+ISPCTraceEnable(int) {
+}
+
+
+int
+ISPCTraceDump(const char *) {
+    return 0;
+}
+
+#endif // ISPC_TASK_TRACE
@@ -0,0 +1,156 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "meshopt.h"
+#include "profile.h"
+#include "raster.h"
+
+/* Headless driver: renders N frames of a model into a plain aligned
+   framebuffer along a fixed camera orbit and reports per-frame latency.
+
+   usage: rasterizer_bench [model.v|model.mesh] [frames] [width] [height]
+                           [linear|tiled] [profile.csv|profile.json]
+
+   Per-stage statistics over the last PROFILE_WINDOW frames are printed at
+   the end and, given a file name, written to it as CSV or JSON.
+
+   With RASTERIZER_MESHLETS set, .v models are reordered with
+   optimize_vmodel() and drawn through meshlets, see src/meshlet.h.
+
+   Worker threads follow ISPC_NUM_THREADS, ISPC_CPUS and ISPC_PIN, see
+   kernel/tasksys.cpp.  With RASTERIZER_TASK_TRACE, ISPC_TRACE=trace.json
+   writes a trace of them. */
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static bool has_suffix(const char *s, const char *suffix)
+{
+    size_t len = strlen(s), suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(s + len - suffix_len, suffix) == 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "model.v";
+    int frames = argc > 2 ? atoi(argv[2]) : 1000;
+    int width = argc > 3 ? atoi(argv[3]) : 512;
+    int height = argc > 4 ? atoi(argv[4]) : 512;
+    const char *layout = argc > 5 ? argv[5] : "linear";
+    const char *profile_path = argc > 6 ? argv[6] : NULL;
+
+    if (frames <= 0 || width <= 0 || height <= 0 ||
+        (strcmp(layout, "linear") != 0 && strcmp(layout, "tiled") != 0)) {
+        fprintf(stderr, "usage: %s [model.v|model.mesh] [frames] [width] [height] [linear|tiled] "
+                "[profile.csv|profile.json]\n", argv[0]);
+        return 1;
+    }
+
+    size_t size = ((sizeof(uint32_t) * width * height) + 63) & ~(size_t)63;
+    uint32_t *pixels = aligned_alloc(64, size);
+    if (!pixels) {
+        fprintf(stderr, "failed to allocate %dx%d framebuffer\n", width, height);
+        return 1;
+    }
+    set_framebuffer_layout(strcmp(layout, "tiled") == 0 ? LAYOUT_TILED : LAYOUT_LINEAR);
+    set_render_target(pixels, width, height);
+
+    // .mesh files draw from their quantized positions, anything else is
+    // taken for a .v model
+    bool is_mesh = has_suffix(path, ".mesh");
+    struct mesh bird_mesh = { 0 };
+    struct vmodel bird_model = { 0 };
+    if (is_mesh)
+        bird_mesh = load_mesh(path);
+    else
+        bird_model = load_vmodel(path);
+    if (is_mesh ? !bird_mesh.mapping : !bird_model.vertices)
+        return 1;
+
+    bool use_meshlets = !is_mesh && getenv("RASTERIZER_MESHLETS");
+    struct meshlet_model meshlets = { 0 };
+    if (use_meshlets) {
+        optimize_vmodel(&bird_model);
+        meshlets = build_meshlets(&bird_model);
+    }
+    long meshlets_drawn = 0;
+
+    int lanes;
+    const char *target = kernel_target(&lanes);
+    printf("kernels: %s, %d lanes\n", target, lanes);
+
+    double *times = malloc(sizeof(double) * frames);
+    double total = 0.0;
+    float t = 0.f;
+
+    for (int i = 0; i < frames; ++i) {
+        double start = now_ms();
+        profile_frame_begin();
+
+        clear(0x00000000, 1.f);
+
+        line(0, 0, buffer_width, buffer_height, 0xffff0000, 0x0000ffff);
+
+        struct float4x4 proj = mat4_perspective_RH(60.f * 3.14f / 180.f, buffer_width / (float)buffer_height, .01f, 100.f);
+        struct float4x4 view = mat4_look_at_RH((struct float3) { sin(t)*4, 2.f, cos(t)*4 }, (struct float3) { 0, 1.5f, 0 }, (struct float3) { 0, 1, 0 });
+        struct float4x4 mat = mat4_mul(view, proj);
+
+        if (is_mesh)
+            draw_mesh(&bird_mesh, mat);
+        else if (use_meshlets)
+            meshlets_drawn += draw_meshlets(&bird_model, &meshlets, mat);
+        else
+            model(bird_model, mat);
+        resolve();
+
+        profile_frame_end();
+        times[i] = now_ms() - start;
+        total += times[i];
+        printf("frame %d: %.3f ms\n", i, times[i]);
+
+        t += 0.01f;
+    }
+
+    qsort(times, frames, sizeof(double), cmp_double);
+    printf("%s %dx%d %s, %d frames: avg %.3f ms, min %.3f ms, median %.3f ms, max %.3f ms\n",
+           path, width, height, layout, frames, total / frames,
+           times[0], times[frames / 2], times[frames - 1]);
+    if (use_meshlets)
+        printf("meshlets: %.1f of %u drawn per frame\n", meshlets_drawn / (double)frames, meshlets.meshlet_count);
+
+    printf("%-10s %9s %9s %9s %9s %9s\n", "stage", "avg", "p50", "p95", "p99", "max");
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        struct profile_stats st = profile_stats(s);
+        printf("%-10s %9.3f %9.3f %9.3f %9.3f %9.3f\n", profile_stage_name(s),
+               st.avg_ms, st.p50_ms, st.p95_ms, st.p99_ms, st.max_ms);
+    }
+
+    if (profile_path) {
+        bool json = has_suffix(profile_path, ".json");
+        if (!(json ? profile_dump_json(profile_path) : profile_dump_csv(profile_path)))
+            return 1;
+    }
+
+    free_meshlets(&meshlets);
+    unload_mesh(&bird_mesh);
+    unload_vmodel(&bird_model);
+    free(times);
+    free(pixels);
+
+    return 0;
+}
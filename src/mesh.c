@@ -0,0 +1,451 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "mesh.h"
+
+void *map_file(const char *path, size_t *size)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    LARGE_INTEGER file_size;
+    void *data = NULL;
+    if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0 &&
+        (uint64_t)file_size.QuadPart <= SIZE_MAX) {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        *size = (size_t)file_size.QuadPart;
+    }
+    CloseHandle(file);
+    return data;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void *data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            data = NULL;
+        *size = st.st_size;
+    }
+    close(fd);
+    return data;
+#endif
+}
+
+void unmap_file(void *data, size_t size)
+{
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(data);
+#else
+    munmap(data, size);
+#endif
+}
+
+struct vmodel load_vmodel(const char *path)
+{
+    struct vmodel model = { 0 };
+
+    size_t size;
+    char *data = map_file(path, &size);
+    if (!data) {
+        fprintf(stderr, "%s: can't map file\n", path);
+        return model;
+    }
+
+    uint32_t counts[2] = { 0, 0 };
+    if (size >= sizeof(counts))
+        memcpy(counts, data, sizeof(counts));
+
+    uint64_t indices_offset = sizeof(counts);
+    uint64_t vertices_offset = indices_offset + (uint64_t)counts[0] * sizeof(uint16_t);
+    uint64_t end = vertices_offset + (uint64_t)counts[1] * sizeof(struct vvertex);
+    if (size < sizeof(counts) || end > size || counts[0] % 3 != 0) {
+        fprintf(stderr, "%s: bad header (%u indices, %u vertices, %zu bytes)\n",
+                path, counts[0], counts[1], size);
+        unmap_file(data, size);
+        return model;
+    }
+
+    /* model() trusts the indices, so check them once here */
+    const uint16_t *indices = (const uint16_t *)(data + indices_offset);
+    for (uint32_t i = 0; i < counts[0]; ++i) {
+        if (indices[i] >= counts[1]) {
+            fprintf(stderr, "%s: index %u out of range (%u vertices)\n", path, indices[i], counts[1]);
+            unmap_file(data, size);
+            return model;
+        }
+    }
+
+    model.index_len = counts[0];
+    model.vertex_len = counts[1];
+    model.indices = (uint16_t *)indices;
+    model.mapping = data;
+    model.mapping_size = size;
+
+    /* With an odd number of indices the vertices are not float aligned
+       in the file, and only those get copied */
+    if ((vertices_offset % _Alignof(struct vvertex)) == 0) {
+        model.vertices = (struct vvertex *)(data + vertices_offset);
+    } else {
+        model.vertices = malloc(model.vertex_len * sizeof(struct vvertex));
+        memcpy(model.vertices, data + vertices_offset, model.vertex_len * sizeof(struct vvertex));
+        model.owns_vertices = true;
+    }
+
+    return model;
+}
+
+void unload_vmodel(struct vmodel *model)
+{
+    if (model->owns_indices)
+        free(model->indices);
+    if (model->owns_vertices)
+        free(model->vertices);
+    if (model->mapping)
+        unmap_file(model->mapping, model->mapping_size);
+    *model = (struct vmodel) { 0 };
+}
+
+// The header is part of the file format
+_Static_assert(sizeof(struct mesh_header) == 160, "struct mesh_header changed size");
+
+/* IEEE half floats, rounding to nearest even */
+static uint16_t float_to_half(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+
+    uint16_t sign = (x >> 16) & 0x8000;
+    uint32_t bits = x & 0x7fffffff;
+
+    if (bits > 0x7f800000)
+        return sign | 0x7e00;
+    // 65520 and up round to infinity
+    if (bits >= 0x477ff000)
+        return sign | 0x7c00;
+    // Below 2^-14 the result is subnormal, in steps of 2^-24
+    if (bits < 0x38800000) {
+        float a;
+        memcpy(&a, &bits, sizeof(a));
+        return sign | (uint16_t)lrintf(a * 16777216.f);
+    }
+
+    uint32_t h = (bits - 0x38000000) >> 13;
+    uint32_t rest = bits & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1)))
+        h++;
+    return sign | (uint16_t)h;
+}
+
+static float half_to_float(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+
+    if (exponent == 0) {
+        float f = mantissa / 16777216.f;
+        return sign ? -f : f;
+    }
+
+    uint32_t x = exponent == 31 ? sign | 0x7f800000 | (mantissa << 13)
+                                : sign | ((exponent + 112) << 23) | (mantissa << 13);
+    float f;
+    memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+static float sign_not_zero(float x)
+{
+    return x < 0.f ? -1.f : 1.f;
+}
+
+/* Projects the unit normal onto the octahedron |x| + |y| + |z| = 1 and
+   folds the lower half over the upper one, leaving two coordinates in
+   [-1, 1]. */
+static void encode_normal(struct float3 n, int16_t out[2])
+{
+    float l1 = fabsf(n.x) + fabsf(n.y) + fabsf(n.z);
+    float u = l1 > 0.f ? n.x / l1 : 0.f;
+    float v = l1 > 0.f ? n.y / l1 : 0.f;
+
+    if (n.z < 0.f) {
+        float fu = (1.f - fabsf(v)) * sign_not_zero(u);
+        float fv = (1.f - fabsf(u)) * sign_not_zero(v);
+        u = fu;
+        v = fv;
+    }
+
+    out[0] = (int16_t)lrintf(fminf(fmaxf(u, -1.f), 1.f) * 32767.f);
+    out[1] = (int16_t)lrintf(fminf(fmaxf(v, -1.f), 1.f) * 32767.f);
+}
+
+static struct float3 decode_normal(const int16_t in[2])
+{
+    float u = fmaxf(in[0] / 32767.f, -1.f);
+    float v = fmaxf(in[1] / 32767.f, -1.f);
+    float z = 1.f - fabsf(u) - fabsf(v);
+
+    if (z < 0.f) {
+        float fu = (1.f - fabsf(v)) * sign_not_zero(u);
+        float fv = (1.f - fabsf(u)) * sign_not_zero(v);
+        u = fu;
+        v = fv;
+    }
+
+    return vec3_normalize((struct float3) { u, v, z });
+}
+
+static uint64_t align_up(uint64_t offset)
+{
+    return (offset + MESH_ALIGN - 1) / MESH_ALIGN * MESH_ALIGN;
+}
+
+static uint64_t stream_size(const struct mesh_header *header, int stream)
+{
+    switch (stream) {
+    case MESH_INDICES:
+        return (uint64_t)header->index_count *
+               ((header->flags & MESH_INDEX32) ? sizeof(uint32_t) : sizeof(uint16_t));
+    case MESH_POSITION_X:
+    case MESH_POSITION_Y:
+    case MESH_POSITION_Z:
+        return (uint64_t)header->vertex_count * sizeof(uint16_t);
+    default:
+        return (uint64_t)header->vertex_count * 2 * sizeof(uint16_t);
+    }
+}
+
+bool write_mesh(const char *path, const uint32_t *indices, uint32_t index_count,
+                const struct vvertex *vertices, uint32_t vertex_count)
+{
+    struct mesh_header header = {
+        .magic = MESH_MAGIC,
+        .version = MESH_VERSION,
+        .header_size = sizeof(struct mesh_header),
+        .index_count = index_count,
+        .vertex_count = vertex_count,
+    };
+
+    for (uint32_t i = 0; i < index_count; ++i) {
+        if (indices[i] > UINT16_MAX)
+            header.flags |= MESH_INDEX32;
+    }
+
+    if (vertex_count > 0) {
+        header.bounds_min = header.bounds_max = vertices[0].position;
+        for (uint32_t i = 1; i < vertex_count; ++i) {
+            struct float3 p = vertices[i].position;
+            header.bounds_min = (struct float3) { fminf(header.bounds_min.x, p.x),
+                                                  fminf(header.bounds_min.y, p.y),
+                                                  fminf(header.bounds_min.z, p.z) };
+            header.bounds_max = (struct float3) { fmaxf(header.bounds_max.x, p.x),
+                                                  fmaxf(header.bounds_max.y, p.y),
+                                                  fmaxf(header.bounds_max.z, p.z) };
+        }
+    }
+
+    // Centered on the bounds, which is within a factor of the smallest
+    // sphere and cheap to test against
+    header.center = vec3_mul_scalar((struct float3) { header.bounds_min.x + header.bounds_max.x,
+                                                      header.bounds_min.y + header.bounds_max.y,
+                                                      header.bounds_min.z + header.bounds_max.z }, .5f);
+    for (uint32_t i = 0; i < vertex_count; ++i)
+        header.radius = fmaxf(header.radius, vec3_length(vec3_sub(vertices[i].position, header.center)));
+
+    uint64_t offset = header.header_size;
+    for (int s = 0; s < MESH_STREAM_COUNT; ++s) {
+        header.streams[s].offset = align_up(offset);
+        header.streams[s].size = stream_size(&header, s);
+        offset = header.streams[s].offset + header.streams[s].size;
+    }
+
+    if (offset > SIZE_MAX) {
+        fprintf(stderr, "%s: mesh too large\n", path);
+        return false;
+    }
+
+    char *data = calloc(1, offset);
+    if (!data) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        return false;
+    }
+    memcpy(data, &header, sizeof(header));
+
+    if (header.flags & MESH_INDEX32) {
+        memcpy(data + header.streams[MESH_INDICES].offset, indices, index_count * sizeof(uint32_t));
+    } else {
+        uint16_t *out = (uint16_t *)(data + header.streams[MESH_INDICES].offset);
+        for (uint32_t i = 0; i < index_count; ++i)
+            out[i] = (uint16_t)indices[i];
+    }
+
+    const float bounds_min[3] = { header.bounds_min.x, header.bounds_min.y, header.bounds_min.z };
+    const float bounds_max[3] = { header.bounds_max.x, header.bounds_max.y, header.bounds_max.z };
+    for (int axis = 0; axis < 3; ++axis) {
+        uint16_t *out = (uint16_t *)(data + header.streams[MESH_POSITION_X + axis].offset);
+        float extent = bounds_max[axis] - bounds_min[axis];
+        float scale = extent > 0.f ? 65535.f / extent : 0.f;
+
+        for (uint32_t i = 0; i < vertex_count; ++i) {
+            const float *p = &vertices[i].position.x;
+            float q = (p[axis] - bounds_min[axis]) * scale;
+            out[i] = (uint16_t)lrintf(fminf(fmaxf(q, 0.f), 65535.f));
+        }
+    }
+
+    int16_t *normals = (int16_t *)(data + header.streams[MESH_NORMAL].offset);
+    uint16_t *texcoords = (uint16_t *)(data + header.streams[MESH_TEXCOORD].offset);
+    for (uint32_t i = 0; i < vertex_count; ++i) {
+        encode_normal(vertices[i].normal, &normals[i * 2]);
+        texcoords[i * 2 + 0] = float_to_half(vertices[i].texcoord.x);
+        texcoords[i * 2 + 1] = float_to_half(vertices[i].texcoord.y);
+    }
+
+    FILE *f = fopen(path, "wb");
+    bool written = f && fwrite(data, 1, offset, f) == offset;
+    if (f && fclose(f) != 0)
+        written = false;
+    if (!written)
+        fprintf(stderr, "%s: can't write file\n", path);
+
+    free(data);
+    return written;
+}
+
+struct mesh load_mesh(const char *path)
+{
+    struct mesh mesh = { 0 };
+
+    size_t size;
+    char *data = map_file(path, &size);
+    if (!data) {
+        fprintf(stderr, "%s: can't map file\n", path);
+        return mesh;
+    }
+
+    // Only the fields this version knows about; a newer header is longer
+    struct mesh_header header = { 0 };
+    memcpy(&header, data, size < sizeof(header) ? size : sizeof(header));
+
+    const char *error = NULL;
+    if (size < 3 * sizeof(uint32_t) || header.magic != MESH_MAGIC)
+        error = "not a mesh file";
+    else if (header.version != MESH_VERSION)
+        error = "unsupported version";
+    else if (header.header_size < sizeof(header) || header.header_size > size)
+        error = "bad header size";
+    else if (header.index_count % 3 != 0)
+        error = "index count not a multiple of 3";
+
+    for (int s = 0; s < MESH_STREAM_COUNT && !error; ++s) {
+        uint64_t offset = header.streams[s].offset;
+        if (offset % MESH_ALIGN != 0 || offset < header.header_size || offset > size ||
+            header.streams[s].size != stream_size(&header, s) ||
+            header.streams[s].size > size - offset)
+            error = "bad stream range";
+    }
+
+    if (error) {
+        fprintf(stderr, "%s: %s\n", path, error);
+        unmap_file(data, size);
+        return mesh;
+    }
+
+    // The renderer trusts the indices, so check them once here
+    const void *indices = data + header.streams[MESH_INDICES].offset;
+    for (uint32_t i = 0; i < header.index_count; ++i) {
+        uint32_t index = (header.flags & MESH_INDEX32) ? ((const uint32_t *)indices)[i]
+                                                       : ((const uint16_t *)indices)[i];
+        if (index >= header.vertex_count) {
+            fprintf(stderr, "%s: index %u out of range (%u vertices)\n", path, index, header.vertex_count);
+            unmap_file(data, size);
+            return mesh;
+        }
+    }
+
+    mesh.index_count = header.index_count;
+    mesh.vertex_count = header.vertex_count;
+    if (header.flags & MESH_INDEX32)
+        mesh.indices32 = indices;
+    else
+        mesh.indices16 = indices;
+    for (int axis = 0; axis < 3; ++axis)
+        mesh.position[axis] = (const uint16_t *)(data + header.streams[MESH_POSITION_X + axis].offset);
+    mesh.normal = (const int16_t *)(data + header.streams[MESH_NORMAL].offset);
+    mesh.texcoord = (const uint16_t *)(data + header.streams[MESH_TEXCOORD].offset);
+
+    mesh.bounds_min = header.bounds_min;
+    mesh.bounds_max = header.bounds_max;
+    mesh.center = header.center;
+    mesh.radius = header.radius;
+    mesh.position_scale = vec3_mul_scalar(vec3_sub(header.bounds_max, header.bounds_min), 1.f / 65535.f);
+
+    mesh.mapping = data;
+    mesh.mapping_size = size;
+    return mesh;
+}
+
+void unload_mesh(struct mesh *mesh)
+{
+    if (mesh->mapping)
+        unmap_file(mesh->mapping, mesh->mapping_size);
+    *mesh = (struct mesh) { 0 };
+}
+
+struct float3 mesh_position(const struct mesh *mesh, uint32_t vertex)
+{
+    return (struct float3) {
+        mesh->bounds_min.x + mesh->position[0][vertex] * mesh->position_scale.x,
+        mesh->bounds_min.y + mesh->position[1][vertex] * mesh->position_scale.y,
+        mesh->bounds_min.z + mesh->position[2][vertex] * mesh->position_scale.z,
+    };
+}
+
+struct float3 mesh_normal(const struct mesh *mesh, uint32_t vertex)
+{
+    return decode_normal(&mesh->normal[vertex * 2]);
+}
+
+struct float2 mesh_texcoord(const struct mesh *mesh, uint32_t vertex)
+{
+    return (struct float2) {
+        half_to_float(mesh->texcoord[vertex * 2 + 0]),
+        half_to_float(mesh->texcoord[vertex * 2 + 1]),
+    };
+}
+
+struct float4x4 mesh_dequantize(const struct mesh *mesh)
+{
+    struct float4x4 m = mat4_identity();
+    m.m[0][0] = mesh->position_scale.x;
+    m.m[1][1] = mesh->position_scale.y;
+    m.m[2][2] = mesh->position_scale.z;
+    m.m[3][0] = mesh->bounds_min.x;
+    m.m[3][1] = mesh->bounds_min.y;
+    m.m[3][2] = mesh->bounds_min.z;
+    return m;
+}
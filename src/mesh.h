@@ -0,0 +1,141 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rmath.h"
+
+struct vvertex {
+    struct float3 position;
+    struct float3 normal;
+    struct float2 texcoord;
+};
+
+/* The original .v model: a header of index_len and vertex_len as
+   uint32_t, followed by the indices as uint16_t and the vertices as
+   struct vvertex. */
+struct vmodel {
+    uint32_t index_len;
+    uint32_t vertex_len;
+    uint16_t *indices;
+    struct vvertex *vertices;
+
+    /* Set by load_vmodel() and optimize_vmodel(), for unload_vmodel() */
+    void *mapping;
+    size_t mapping_size;
+    bool owns_indices;
+    bool owns_vertices;
+};
+
+/* Maps the model file read-only and points `indices` and `vertices` into
+   it, copying the vertices only when the file doesn't keep them aligned.
+   Returns a model with no indices or vertices, after printing why, if the
+   file can't be read or its sizes or indices don't check out. */
+struct vmodel load_vmodel(const char *path);
+void unload_vmodel(struct vmodel *model);
+
+/* The .mesh format, laid out to be drawn straight from a read-only
+   mapping.  A struct mesh_header is followed by the streams, each starting
+   at a multiple of MESH_ALIGN bytes from the start of the file:
+
+   MESH_INDICES     index_count uint16_t, or uint32_t with MESH_INDEX32
+   MESH_POSITION_*  vertex_count uint16_t, the position quantized to
+                    bounds_min + q * (bounds_max - bounds_min) / 65535
+   MESH_NORMAL      vertex_count pairs of int16_t, the unit normal in
+                    octahedral encoding, as snorm
+   MESH_TEXCOORD    vertex_count pairs of IEEE half floats
+
+   All values are little-endian.  Readers reject a different `version`,
+   and skip header fields past the ones they know about, up to
+   `header_size`. */
+#define MESH_MAGIC 0x4853454du /* "MESH" */
+#define MESH_VERSION 1
+#define MESH_ALIGN 64
+
+enum mesh_stream {
+    MESH_INDICES,
+    MESH_POSITION_X,
+    MESH_POSITION_Y,
+    MESH_POSITION_Z,
+    MESH_NORMAL,
+    MESH_TEXCOORD,
+    MESH_STREAM_COUNT,
+};
+
+enum mesh_flags {
+    MESH_INDEX32 = 1 << 0,
+};
+
+struct mesh_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t flags;
+    uint32_t index_count;
+    uint32_t vertex_count;
+
+    /* Bounds of the positions before quantization, and a sphere around
+       them */
+    struct float3 bounds_min;
+    struct float3 bounds_max;
+    struct float3 center;
+    float radius;
+
+    struct {
+        uint64_t offset;
+        uint64_t size;
+    } streams[MESH_STREAM_COUNT];
+};
+
+/* A loaded .mesh, pointing into its mapping.  Exactly one of `indices16`
+   and `indices32` is set. */
+struct mesh {
+    uint32_t index_count;
+    uint32_t vertex_count;
+    const uint16_t *indices16;
+    const uint32_t *indices32;
+    const uint16_t *position[3];
+    const int16_t *normal;
+    const uint16_t *texcoord;
+
+    struct float3 bounds_min;
+    struct float3 bounds_max;
+    struct float3 center;
+    float radius;
+    /* position = bounds_min + q * position_scale */
+    struct float3 position_scale;
+
+    void *mapping;
+    size_t mapping_size;
+};
+
+/* Maps a .mesh file read-only.  Like load_vmodel(), checks the header,
+   the stream ranges and the indices, and returns an empty mesh after
+   printing why if they don't check out. */
+struct mesh load_mesh(const char *path);
+void unload_mesh(struct mesh *mesh);
+
+/* Quantizes and encodes the vertices and writes them and the indices as a
+   .mesh file, with 16-bit indices when every index fits.  Returns false,
+   after printing why, if the file can't be written. */
+bool write_mesh(const char *path, const uint32_t *indices, uint32_t index_count,
+                const struct vvertex *vertices, uint32_t vertex_count);
+
+/* Decodes one vertex attribute, for the few places that need them as
+   floats. */
+struct float3 mesh_position(const struct mesh *mesh, uint32_t vertex);
+struct float3 mesh_normal(const struct mesh *mesh, uint32_t vertex);
+struct float2 mesh_texcoord(const struct mesh *mesh, uint32_t vertex);
+
+/* The matrix taking quantized positions to model space, to put in front
+   of a model matrix so the positions never need decoding. */
+struct float4x4 mesh_dequantize(const struct mesh *mesh);
+
+/* Maps a whole file read-only; NULL if it can't be opened or is empty. */
+void *map_file(const char *path, size_t *size);
+void unmap_file(void *data, size_t size);
+
+#endif
@@ -0,0 +1,53 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mesh.h"
+#include "meshopt.h"
+
+/* Offline converter from the .v models load_vmodel() reads to the .mesh
+   format in src/mesh.h.  With -O the triangles and vertices are reordered
+   first, see src/meshopt.h.
+
+   usage: meshconv [-O] input.v output.mesh */
+
+int main(int argc, char **argv)
+{
+    bool optimize = argc > 1 && strcmp(argv[1], "-O") == 0;
+    if (argc != 3 + optimize) {
+        fprintf(stderr, "usage: %s [-O] input.v output.mesh\n", argv[0]);
+        return 1;
+    }
+    const char *input = argv[1 + optimize];
+    const char *output = argv[2 + optimize];
+
+    struct vmodel model = load_vmodel(input);
+    if (!model.vertices)
+        return 1;
+
+    uint32_t *indices = malloc(sizeof(uint32_t) * (model.index_len ? model.index_len : 1));
+    for (uint32_t i = 0; i < model.index_len; ++i)
+        indices[i] = model.indices[i];
+
+    if (optimize) {
+        struct vertex_cache_stats before = vertex_cache_stats(indices, model.index_len, model.vertex_len,
+                                                              MESHOPT_CACHE_SIZE);
+        optimize_vmodel(&model);
+        for (uint32_t i = 0; i < model.index_len; ++i)
+            indices[i] = model.indices[i];
+        struct vertex_cache_stats after = vertex_cache_stats(indices, model.index_len, model.vertex_len,
+                                                             MESHOPT_CACHE_SIZE);
+        printf("%s: acmr %.3f -> %.3f, atvr %.3f -> %.3f\n", input,
+               before.acmr, after.acmr, before.atvr, after.atvr);
+    }
+
+    bool written = write_mesh(output, indices, model.index_len, model.vertices, model.vertex_len);
+    if (written)
+        printf("%s: %u indices, %u vertices\n", output, model.index_len, model.vertex_len);
+
+    free(indices);
+    unload_vmodel(&model);
+    return written ? 0 : 1;
+}
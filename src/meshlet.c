@@ -0,0 +1,131 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "meshlet.h"
+
+static void meshlet_bounds(struct meshlet *meshlet, const struct vmodel *model,
+                           const uint32_t *vertices, const uint8_t *triangles)
+{
+    const uint32_t *ids = &vertices[meshlet->vertex_offset];
+    const uint8_t *local = &triangles[meshlet->triangle_offset * 3];
+
+    struct float3 lo = model->vertices[ids[0]].position, hi = lo;
+    for (uint32_t i = 1; i < meshlet->vertex_count; ++i) {
+        struct float3 p = model->vertices[ids[i]].position;
+        lo = (struct float3) { fminf(lo.x, p.x), fminf(lo.y, p.y), fminf(lo.z, p.z) };
+        hi = (struct float3) { fmaxf(hi.x, p.x), fmaxf(hi.y, p.y), fmaxf(hi.z, p.z) };
+    }
+
+    meshlet->center = (struct float3) { (lo.x + hi.x) * .5f, (lo.y + hi.y) * .5f, (lo.z + hi.z) * .5f };
+    meshlet->radius = 0.f;
+    for (uint32_t i = 0; i < meshlet->vertex_count; ++i) {
+        struct float3 p = model->vertices[ids[i]].position;
+        meshlet->radius = fmaxf(meshlet->radius, vec3_length(vec3_sub(p, meshlet->center)));
+    }
+
+    // The cone around the face normals: its axis is their average, its
+    // cutoff the sine of the widest angle any of them makes with it
+    struct float3 axis = { 0 };
+    for (uint32_t t = 0; t < meshlet->triangle_count; ++t) {
+        struct float3 a = model->vertices[ids[local[t * 3 + 0]]].position;
+        struct float3 b = model->vertices[ids[local[t * 3 + 1]]].position;
+        struct float3 c = model->vertices[ids[local[t * 3 + 2]]].position;
+
+        struct float3 n = vec3_cross(vec3_sub(b, a), vec3_sub(c, a));
+        float length = vec3_length(n);
+        if (length > 0.f)
+            axis = (struct float3) { axis.x + n.x / length, axis.y + n.y / length, axis.z + n.z / length };
+    }
+
+    meshlet->cone_axis = axis;
+    meshlet->cone_cutoff = 1.f;
+    float axis_length = vec3_length(axis);
+    if (axis_length == 0.f)
+        return;
+    axis = vec3_mul_scalar(axis, 1.f / axis_length);
+    meshlet->cone_axis = axis;
+
+    float min_dot = 1.f;
+    for (uint32_t t = 0; t < meshlet->triangle_count; ++t) {
+        struct float3 a = model->vertices[ids[local[t * 3 + 0]]].position;
+        struct float3 b = model->vertices[ids[local[t * 3 + 1]]].position;
+        struct float3 c = model->vertices[ids[local[t * 3 + 2]]].position;
+
+        struct float3 n = vec3_cross(vec3_sub(b, a), vec3_sub(c, a));
+        float length = vec3_length(n);
+        if (length > 0.f)
+            min_dot = fminf(min_dot, vec3_dot(n, axis) / length);
+    }
+
+    // Cones about as wide as a half space and more hardly ever cull
+    if (min_dot > .1f)
+        meshlet->cone_cutoff = sqrtf(1.f - min_dot * min_dot);
+}
+
+struct meshlet_model build_meshlets(const struct vmodel *model)
+{
+    uint32_t triangle_count = model->index_len / 3;
+    uint32_t capacity = triangle_count ? triangle_count : 1;
+
+    struct meshlet_model meshlets = {
+        .meshlets = malloc(sizeof(struct meshlet) * capacity),
+        .vertices = malloc(sizeof(uint32_t) * capacity * 3),
+        .triangles = malloc(sizeof(uint8_t) * capacity * 3),
+    };
+    if (triangle_count == 0)
+        return meshlets;
+
+    // Which meshlet each model vertex was last added to, plus one, and
+    // where in it
+    uint32_t *owner = calloc(model->vertex_len, sizeof(uint32_t));
+    uint8_t *slot = malloc(model->vertex_len ? model->vertex_len : 1);
+
+    struct meshlet meshlet = { 0 };
+    for (uint32_t t = 0; t < triangle_count; ++t) {
+        const uint16_t *triangle = &model->indices[t * 3];
+        uint32_t id = meshlets.meshlet_count + 1;
+
+        int added = 0;
+        for (int k = 0; k < 3; ++k) {
+            bool repeat = (k > 0 && triangle[k] == triangle[0]) || (k > 1 && triangle[k] == triangle[1]);
+            added += owner[triangle[k]] != id && !repeat;
+        }
+
+        if (meshlet.vertex_count + added > MESHLET_MAX_VERTICES ||
+            meshlet.triangle_count == MESHLET_MAX_TRIANGLES) {
+            meshlet_bounds(&meshlet, model, meshlets.vertices, meshlets.triangles);
+            meshlets.meshlets[meshlets.meshlet_count++] = meshlet;
+            meshlet = (struct meshlet) { .vertex_offset = meshlets.vertex_count, .triangle_offset = t };
+            id++;
+        }
+
+        for (int k = 0; k < 3; ++k) {
+            uint32_t v = triangle[k];
+            if (owner[v] != id) {
+                owner[v] = id;
+                slot[v] = (uint8_t)meshlet.vertex_count++;
+                meshlets.vertices[meshlets.vertex_count++] = v;
+            }
+            meshlets.triangles[t * 3 + k] = slot[v];
+        }
+        meshlet.triangle_count++;
+    }
+
+    meshlet_bounds(&meshlet, model, meshlets.vertices, meshlets.triangles);
+    meshlets.meshlets[meshlets.meshlet_count++] = meshlet;
+
+    free(slot);
+    free(owner);
+    return meshlets;
+}
+
+void free_meshlets(struct meshlet_model *meshlets)
+{
+    free(meshlets->meshlets);
+    free(meshlets->vertices);
+    free(meshlets->triangles);
+    *meshlets = (struct meshlet_model) { 0 };
+}
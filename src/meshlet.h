@@ -0,0 +1,50 @@
+#ifndef MESHLET_H
+#define MESHLET_H
+
+#include <stdint.h>
+
+#include "mesh.h"
+
+/* Meshlets split a model into small clusters of triangles that are culled
+   as a whole, against the view frustum and when every triangle faces
+   away, before any of their vertices are transformed.  Meshlets are cut
+   from the index list in order, so they are only as compact as that
+   order; run optimize_vmodel() (src/meshopt.h) first. */
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+struct meshlet {
+    /* The meshlet's vertices are vertices[vertex_offset] on, its triangles
+       the three meshlet vertices at triangles[triangle_offset * 3] on */
+    uint32_t vertex_offset;
+    uint32_t triangle_offset;
+    uint32_t vertex_count;
+    uint32_t triangle_count;
+
+    /* Bounding sphere, in model space */
+    struct float3 center;
+    float radius;
+
+    /* Normal cone: every triangle faces away from a camera at p when
+       dot(center - p, cone_axis) >= cone_cutoff * |center - p| + radius.
+       A cutoff of 1 never culls. */
+    struct float3 cone_axis;
+    float cone_cutoff;
+};
+
+struct meshlet_model {
+    struct meshlet *meshlets;
+    uint32_t meshlet_count;
+    /* Model vertex of every meshlet vertex */
+    uint32_t *vertices;
+    uint32_t vertex_count;
+    /* Three meshlet vertices per triangle */
+    uint8_t *triangles;
+};
+
+/* The triangles keep their order, so triangle_offset counts triangles of
+   the model's index list.  The model has to outlive the meshlets. */
+struct meshlet_model build_meshlets(const struct vmodel *model);
+void free_meshlets(struct meshlet_model *meshlets);
+
+#endif
@@ -0,0 +1,362 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "meshopt.h"
+
+/* A FIFO cache of `size` vertices, by the time each vertex last missed:
+   a vertex is cached while fewer than `size` others have missed since. */
+struct fifo_cache {
+    uint32_t *stamps;
+    uint32_t time;
+    int size;
+};
+
+static void cache_init(struct fifo_cache *cache, size_t vertex_count, int size)
+{
+    cache->stamps = calloc(vertex_count ? vertex_count : 1, sizeof(uint32_t));
+    cache->size = size;
+    cache->time = size + 1;
+}
+
+static void cache_flush(struct fifo_cache *cache)
+{
+    cache->time += cache->size + 1;
+}
+
+static int cache_misses(struct fifo_cache *cache, const uint32_t triangle[3])
+{
+    int misses = 0;
+    for (int k = 0; k < 3; ++k) {
+        uint32_t v = triangle[k];
+        if (cache->time - cache->stamps[v] > (uint32_t)cache->size) {
+            cache->stamps[v] = cache->time++;
+            misses++;
+        }
+    }
+    return misses;
+}
+
+struct vertex_cache_stats vertex_cache_stats(const uint32_t *indices, size_t index_count,
+                                             size_t vertex_count, int cache_size)
+{
+    struct vertex_cache_stats stats = { 0 };
+    struct fifo_cache cache;
+    cache_init(&cache, vertex_count, cache_size);
+
+    size_t misses = 0;
+    for (size_t i = 0; i + 2 < index_count; i += 3)
+        misses += cache_misses(&cache, &indices[i]);
+
+    // Vertices used are the ones with a stamp
+    size_t used = 0;
+    for (size_t v = 0; v < vertex_count; ++v)
+        used += cache.stamps[v] != 0;
+
+    if (index_count >= 3)
+        stats.acmr = misses / (float)(index_count / 3);
+    if (used > 0)
+        stats.atvr = misses / (float)used;
+
+    free(cache.stamps);
+    return stats;
+}
+
+/* Triangles around every vertex: those of vertex v are
+   triangles[offsets[v]] up to triangles[offsets[v + 1]]. */
+struct adjacency {
+    uint32_t *offsets;
+    uint32_t *triangles;
+};
+
+static struct adjacency build_adjacency(const uint32_t *indices, size_t index_count, size_t vertex_count)
+{
+    struct adjacency adjacency = {
+        .offsets = calloc(vertex_count + 1, sizeof(uint32_t)),
+        .triangles = malloc(sizeof(uint32_t) * (index_count ? index_count : 1)),
+    };
+
+    for (size_t i = 0; i < index_count; ++i)
+        adjacency.offsets[indices[i] + 1]++;
+    for (size_t v = 0; v < vertex_count; ++v)
+        adjacency.offsets[v + 1] += adjacency.offsets[v];
+
+    uint32_t *fill = malloc(sizeof(uint32_t) * (vertex_count ? vertex_count : 1));
+    memcpy(fill, adjacency.offsets, sizeof(uint32_t) * vertex_count);
+    for (size_t i = 0; i < index_count; ++i)
+        adjacency.triangles[fill[indices[i]]++] = (uint32_t)(i / 3);
+    free(fill);
+
+    return adjacency;
+}
+
+/* Sander, Nehab and Barczak, "Fast Triangle Reordering for Vertex Locality
+   and Reduced Overdraw" (2007).  Emits every remaining triangle around a
+   fanning vertex, then moves on to the vertex just emitted that is still
+   used and would stay cached the longest; with none, to the most recently
+   emitted vertex still in use, then to the lowest numbered one. */
+void optimize_vertex_cache(uint32_t *indices, size_t index_count, size_t vertex_count, int cache_size)
+{
+    size_t triangle_count = index_count / 3;
+    if (triangle_count == 0 || vertex_count == 0)
+        return;
+
+    struct adjacency adjacency = build_adjacency(indices, triangle_count * 3, vertex_count);
+
+    uint32_t *live = malloc(sizeof(uint32_t) * vertex_count);
+    uint32_t *stamps = calloc(vertex_count, sizeof(uint32_t));
+    bool *emitted = calloc(triangle_count, sizeof(bool));
+    uint32_t *dead_ends = malloc(sizeof(uint32_t) * triangle_count * 3);
+    uint32_t *candidates = malloc(sizeof(uint32_t) * triangle_count * 3);
+    uint32_t *out = malloc(sizeof(uint32_t) * triangle_count * 3);
+
+    for (size_t v = 0; v < vertex_count; ++v)
+        live[v] = adjacency.offsets[v + 1] - adjacency.offsets[v];
+
+    size_t dead_end_count = 0;
+    size_t out_count = 0;
+    size_t cursor = 0;
+    uint32_t time = cache_size + 1;
+
+    int64_t fan = indices[0];
+    while (fan >= 0) {
+        size_t candidate_count = 0;
+
+        for (uint32_t a = adjacency.offsets[fan]; a < adjacency.offsets[fan + 1]; ++a) {
+            uint32_t t = adjacency.triangles[a];
+            if (emitted[t])
+                continue;
+            emitted[t] = true;
+
+            for (int k = 0; k < 3; ++k) {
+                uint32_t v = indices[t * 3 + k];
+                out[out_count++] = v;
+                dead_ends[dead_end_count++] = v;
+                candidates[candidate_count++] = v;
+                live[v]--;
+                if (time - stamps[v] > (uint32_t)cache_size)
+                    stamps[v] = time++;
+            }
+        }
+
+        // The candidate still cached after its remaining triangles'
+        // vertices go through the cache, and longest in it
+        fan = -1;
+        int64_t best = -1;
+        for (size_t c = 0; c < candidate_count; ++c) {
+            uint32_t v = candidates[c];
+            if (live[v] == 0)
+                continue;
+
+            int64_t priority = 0;
+            if (time - stamps[v] + 2 * live[v] <= (uint32_t)cache_size)
+                priority = time - stamps[v];
+            if (priority > best) {
+                best = priority;
+                fan = v;
+            }
+        }
+
+        while (fan < 0 && dead_end_count > 0) {
+            uint32_t v = dead_ends[--dead_end_count];
+            if (live[v] > 0)
+                fan = v;
+        }
+
+        while (fan < 0 && cursor < vertex_count) {
+            if (live[cursor] > 0)
+                fan = cursor;
+            cursor++;
+        }
+    }
+
+    memcpy(indices, out, sizeof(uint32_t) * out_count);
+
+    free(out);
+    free(candidates);
+    free(dead_ends);
+    free(emitted);
+    free(stamps);
+    free(live);
+    free(adjacency.triangles);
+    free(adjacency.offsets);
+}
+
+struct cluster {
+    float key;
+    uint32_t start;
+    uint32_t end;
+};
+
+static int cmp_cluster(const void *a, const void *b)
+{
+    const struct cluster *ca = a, *cb = b;
+    if (ca->key != cb->key)
+        return ca->key < cb->key ? 1 : -1;
+    return (ca->start > cb->start) - (ca->start < cb->start);
+}
+
+/* Also from Sander et al.  Clusters start wherever the cache order already
+   restarts (all three vertices miss), and are split further wherever the
+   reuse so far is within `threshold` of the cluster's.  Clusters are then
+   sorted by how far out from the mesh center they face, which draws the
+   outer surfaces, the ones that occlude, first from most directions. */
+void optimize_overdraw(uint32_t *indices, size_t index_count,
+                       const struct vvertex *vertices, size_t vertex_count, float threshold)
+{
+    size_t triangle_count = index_count / 3;
+    if (triangle_count < 2)
+        return;
+
+    struct fifo_cache cache;
+    cache_init(&cache, vertex_count, MESHOPT_CACHE_SIZE);
+
+    uint32_t *hard = malloc(sizeof(uint32_t) * (triangle_count + 1));
+    size_t hard_count = 0;
+    for (size_t t = 0; t < triangle_count; ++t) {
+        if (cache_misses(&cache, &indices[t * 3]) == 3 || t == 0)
+            hard[hard_count++] = (uint32_t)t;
+    }
+    hard[hard_count] = (uint32_t)triangle_count;
+
+    struct cluster *clusters = malloc(sizeof(struct cluster) * triangle_count);
+    size_t cluster_count = 0;
+    for (size_t h = 0; h < hard_count; ++h) {
+        uint32_t start = hard[h], end = hard[h + 1];
+
+        cache_flush(&cache);
+        int misses = 0;
+        for (uint32_t t = start; t < end; ++t)
+            misses += cache_misses(&cache, &indices[t * 3]);
+        float target = threshold * misses / (float)(end - start);
+
+        cache_flush(&cache);
+        misses = 0;
+        for (uint32_t t = start; t < end; ++t) {
+            misses += cache_misses(&cache, &indices[t * 3]);
+            if (t + 1 < end && misses <= target * (t + 1 - start)) {
+                clusters[cluster_count++] = (struct cluster) { 0.f, start, t + 1 };
+                start = t + 1;
+                cache_flush(&cache);
+                misses = 0;
+            }
+        }
+        clusters[cluster_count++] = (struct cluster) { 0.f, start, end };
+    }
+    free(hard);
+    free(cache.stamps);
+
+    // Area weighted centroids; the cross products are twice the area
+    // along the face normal
+    struct float3 mesh_center = { 0 };
+    float mesh_area = 0.f;
+    struct float3 *centers = malloc(sizeof(struct float3) * cluster_count);
+    struct float3 *normals = malloc(sizeof(struct float3) * cluster_count);
+
+    for (size_t c = 0; c < cluster_count; ++c) {
+        struct float3 center = { 0 }, normal = { 0 };
+        float area = 0.f;
+
+        for (uint32_t t = clusters[c].start; t < clusters[c].end; ++t) {
+            struct float3 a = vertices[indices[t * 3 + 0]].position;
+            struct float3 b = vertices[indices[t * 3 + 1]].position;
+            struct float3 d = vertices[indices[t * 3 + 2]].position;
+
+            struct float3 n = vec3_cross(vec3_sub(b, a), vec3_sub(d, a));
+            float w = vec3_length(n);
+            struct float3 mid = { (a.x + b.x + d.x) / 3.f, (a.y + b.y + d.y) / 3.f, (a.z + b.z + d.z) / 3.f };
+
+            center = (struct float3) { center.x + mid.x * w, center.y + mid.y * w, center.z + mid.z * w };
+            normal = (struct float3) { normal.x + n.x, normal.y + n.y, normal.z + n.z };
+            area += w;
+        }
+
+        mesh_center = (struct float3) { mesh_center.x + center.x, mesh_center.y + center.y, mesh_center.z + center.z };
+        mesh_area += area;
+        centers[c] = area > 0.f ? vec3_mul_scalar(center, 1.f / area) : center;
+        normals[c] = normal;
+    }
+    if (mesh_area > 0.f)
+        mesh_center = vec3_mul_scalar(mesh_center, 1.f / mesh_area);
+
+    for (size_t c = 0; c < cluster_count; ++c) {
+        float length = vec3_length(normals[c]);
+        if (length > 0.f)
+            clusters[c].key = vec3_dot(vec3_sub(centers[c], mesh_center), normals[c]) / length;
+    }
+    free(normals);
+    free(centers);
+
+    qsort(clusters, cluster_count, sizeof(struct cluster), cmp_cluster);
+
+    uint32_t *out = malloc(sizeof(uint32_t) * triangle_count * 3);
+    size_t out_count = 0;
+    for (size_t c = 0; c < cluster_count; ++c) {
+        size_t count = (clusters[c].end - clusters[c].start) * 3;
+        memcpy(&out[out_count], &indices[clusters[c].start * 3], sizeof(uint32_t) * count);
+        out_count += count;
+    }
+    memcpy(indices, out, sizeof(uint32_t) * out_count);
+
+    free(out);
+    free(clusters);
+}
+
+size_t optimize_vertex_fetch(uint32_t *indices, size_t index_count,
+                             struct vvertex *vertices, size_t vertex_count)
+{
+    uint32_t *remap = malloc(sizeof(uint32_t) * (vertex_count ? vertex_count : 1));
+    memset(remap, 0xff, sizeof(uint32_t) * vertex_count);
+
+    uint32_t next = 0;
+    for (size_t i = 0; i < index_count; ++i) {
+        uint32_t v = indices[i];
+        if (remap[v] == UINT32_MAX)
+            remap[v] = next++;
+        indices[i] = remap[v];
+    }
+
+    struct vvertex *original = malloc(sizeof(struct vvertex) * (vertex_count ? vertex_count : 1));
+    memcpy(original, vertices, sizeof(struct vvertex) * vertex_count);
+    for (size_t v = 0; v < vertex_count; ++v) {
+        if (remap[v] != UINT32_MAX)
+            vertices[remap[v]] = original[v];
+    }
+
+    free(original);
+    free(remap);
+    return next;
+}
+
+void optimize_vmodel(struct vmodel *model)
+{
+    size_t index_count = model->index_len;
+    size_t vertex_count = model->vertex_len;
+
+    uint32_t *indices = malloc(sizeof(uint32_t) * (index_count ? index_count : 1));
+    for (size_t i = 0; i < index_count; ++i)
+        indices[i] = model->indices[i];
+
+    struct vvertex *vertices = malloc(sizeof(struct vvertex) * (vertex_count ? vertex_count : 1));
+    memcpy(vertices, model->vertices, sizeof(struct vvertex) * vertex_count);
+
+    optimize_vertex_cache(indices, index_count, vertex_count, MESHOPT_CACHE_SIZE);
+    optimize_overdraw(indices, index_count, vertices, vertex_count, 1.05f);
+    vertex_count = optimize_vertex_fetch(indices, index_count, vertices, vertex_count);
+
+    // Fewer vertices than before, so the indices still fit
+    uint16_t *indices16 = malloc(sizeof(uint16_t) * (index_count ? index_count : 1));
+    for (size_t i = 0; i < index_count; ++i)
+        indices16[i] = (uint16_t)indices[i];
+    free(indices);
+
+    unload_vmodel(model);
+    model->index_len = (uint32_t)index_count;
+    model->vertex_len = (uint32_t)vertex_count;
+    model->indices = indices16;
+    model->vertices = vertices;
+    model->owns_indices = true;
+    model->owns_vertices = true;
+}
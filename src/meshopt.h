@@ -0,0 +1,48 @@
+#ifndef MESHOPT_H
+#define MESHOPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mesh.h"
+
+/* Reordering passes over indexed triangle lists, run in this order: each
+   keeps the triangles themselves (and their winding) and only changes the
+   order they are drawn in or the order of the vertices.
+
+   optimize_vertex_cache  orders triangles for reuse of recently
+                          transformed vertices (Tipsify)
+   optimize_overdraw      splits that order into clusters and sorts them
+                          so outward facing ones come first, keeping most
+                          of the reuse
+   optimize_vertex_fetch  renumbers the vertices in order of first use,
+                          dropping unused ones, and returns how many are
+                          left */
+
+/* Vertices a FIFO post-transform cache holds, what the passes and
+   vertex_cache_stats() model */
+#define MESHOPT_CACHE_SIZE 16
+
+void optimize_vertex_cache(uint32_t *indices, size_t index_count, size_t vertex_count, int cache_size);
+/* `threshold` is how much worse than the input's, per triangle, the
+   reuse within a cluster may get; around 1.05. */
+void optimize_overdraw(uint32_t *indices, size_t index_count,
+                       const struct vvertex *vertices, size_t vertex_count, float threshold);
+size_t optimize_vertex_fetch(uint32_t *indices, size_t index_count,
+                             struct vvertex *vertices, size_t vertex_count);
+
+struct vertex_cache_stats {
+    /* Cache misses per triangle, 0.5 at best and 3 at worst */
+    float acmr;
+    /* Cache misses per vertex used, 1 at best */
+    float atvr;
+};
+
+struct vertex_cache_stats vertex_cache_stats(const uint32_t *indices, size_t index_count,
+                                             size_t vertex_count, int cache_size);
+
+/* Runs all three passes on a loaded model, replacing its indices and
+   vertices with reordered copies it owns. */
+void optimize_vmodel(struct vmodel *model);
+
+#endif
@@ -0,0 +1,169 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "profile.h"
+
+static const char *stage_names[STAGE_COUNT] = {
+    "clear",
+    "transform",
+    "setup",
+    "raster",
+    "resolve",
+    "present",
+    "frame",
+};
+
+static struct {
+    double start[STAGE_COUNT];
+    double frame[STAGE_COUNT];      /* this frame's time so far */
+    double window[STAGE_COUNT][PROFILE_WINDOW];
+    int frames;                     /* frames ever recorded */
+} profile;
+
+static double now_ms()
+{
+#ifdef _WIN32
+    LARGE_INTEGER count, frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return count.QuadPart * 1000.0 / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+#endif
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double da = *(const double *)a, db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+void profile_frame_begin()
+{
+    memset(profile.frame, 0, sizeof(profile.frame));
+    profile_begin(STAGE_FRAME);
+}
+
+void profile_frame_end()
+{
+    profile_end(STAGE_FRAME);
+
+    int slot = profile.frames % PROFILE_WINDOW;
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        profile.window[s][slot] = profile.frame[s];
+        profile.frame[s] = 0.0;
+    }
+    profile.frames++;
+}
+
+void profile_begin(enum profile_stage stage)
+{
+    profile.start[stage] = now_ms();
+}
+
+void profile_end(enum profile_stage stage)
+{
+    profile.frame[stage] += now_ms() - profile.start[stage];
+}
+
+double profile_now()
+{
+    return now_ms();
+}
+
+void profile_add(enum profile_stage stage, double ms)
+{
+    profile.frame[stage] += ms;
+}
+
+const char *profile_stage_name(enum profile_stage stage)
+{
+    return stage_names[stage];
+}
+
+/* Nearest-rank percentile of n sorted samples. */
+static double percentile(const double *sorted, int n, int p)
+{
+    int rank = (p * n + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+struct profile_stats profile_stats(enum profile_stage stage)
+{
+    struct profile_stats stats = { 0 };
+    int n = profile.frames < PROFILE_WINDOW ? profile.frames : PROFILE_WINDOW;
+    if (n == 0)
+        return stats;
+
+    double sorted[PROFILE_WINDOW];
+    double total = 0.0;
+    memcpy(sorted, profile.window[stage], sizeof(double) * n);
+    for (int i = 0; i < n; ++i)
+        total += sorted[i];
+    qsort(sorted, n, sizeof(double), cmp_double);
+
+    stats.frames = n;
+    stats.avg_ms = total / n;
+    stats.p50_ms = percentile(sorted, n, 50);
+    stats.p95_ms = percentile(sorted, n, 95);
+    stats.p99_ms = percentile(sorted, n, 99);
+    stats.max_ms = sorted[n - 1];
+    return stats;
+}
+
+static bool close_dump(FILE *f, const char *path)
+{
+    bool ok = !ferror(f);
+    ok = fclose(f) == 0 && ok;
+    if (!ok)
+        fprintf(stderr, "failed to write %s\n", path);
+    return ok;
+}
+
+bool profile_dump_csv(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return false;
+    }
+
+    fprintf(f, "stage,frames,avg_ms,p50_ms,p95_ms,p99_ms,max_ms\n");
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        struct profile_stats st = profile_stats(s);
+        fprintf(f, "%s,%d,%.4f,%.4f,%.4f,%.4f,%.4f\n", stage_names[s], st.frames,
+                st.avg_ms, st.p50_ms, st.p95_ms, st.p99_ms, st.max_ms);
+    }
+
+    return close_dump(f, path);
+}
+
+bool profile_dump_json(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "failed to open %s\n", path);
+        return false;
+    }
+
+    fprintf(f, "{\n");
+    for (int s = 0; s < STAGE_COUNT; ++s) {
+        struct profile_stats st = profile_stats(s);
+        fprintf(f, "  \"%s\": { \"frames\": %d, \"avg_ms\": %.4f, \"p50_ms\": %.4f, "
+                "\"p95_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f }%s\n",
+                stage_names[s], st.frames, st.avg_ms, st.p50_ms, st.p95_ms, st.p99_ms, st.max_ms,
+                s + 1 < STAGE_COUNT ? "," : "");
+    }
+    fprintf(f, "}\n");
+
+    return close_dump(f, path);
+}
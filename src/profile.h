@@ -0,0 +1,48 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+
+/* Per-frame timings of the pipeline stages.  Each stage's time is summed
+   over the profile_begin()/profile_end() pairs of a frame, which are
+   closed off by profile_frame_end(), and statistics are taken over the
+   last PROFILE_WINDOW frames. */
+enum profile_stage {
+    STAGE_CLEAR,
+    STAGE_TRANSFORM,
+    STAGE_SETUP,        /* triangle setup, clipping and binning */
+    STAGE_RASTER,
+    STAGE_RESOLVE,
+    STAGE_PRESENT,
+    STAGE_FRAME,        /* profile_frame_begin() to profile_frame_end() */
+    STAGE_COUNT,
+};
+
+#define PROFILE_WINDOW 1024
+
+struct profile_stats {
+    int frames;
+    double avg_ms, p50_ms, p95_ms, p99_ms, max_ms;
+};
+
+void profile_frame_begin(void);
+void profile_frame_end(void);
+
+void profile_begin(enum profile_stage stage);
+void profile_end(enum profile_stage stage);
+
+/* For stages that run on other threads, which must not call the above:
+   they take timestamps with profile_now(), which any thread may call, and
+   the thread that profiles adds the times with profile_add(). */
+double profile_now(void);
+void profile_add(enum profile_stage stage, double ms);
+
+const char *profile_stage_name(enum profile_stage stage);
+struct profile_stats profile_stats(enum profile_stage stage);
+
+/* Writes the statistics of every stage; false if the file can't be
+   written. */
+bool profile_dump_csv(const char *path);
+bool profile_dump_json(const char *path);
+
+#endif
@@ -0,0 +1,992 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+
+#include "profile.h"
+#include "raster.h"
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+uint32_t *buffer = NULL;
+float *zbuffer = NULL;
+int buffer_width, buffer_height;
+
+extern void clear_targets(uint32_t **targets, const uint32_t *values, int target_count,
+                          int width, int height,
+                          const uint8_t *tile_mask, int tile_size);
+
+extern void transform_vertices_span(const struct vvertex *vertices, int stride, int count,
+                                    int span, int span_index,
+                                    const struct float4x4 *mat, const struct float4x4 *viewport,
+                                    float guard_x, float guard_y,
+                                    float *xs, float *ys, float *zs, int *outcodes);
+
+extern void transform_meshlets_span(const struct vvertex *vertices, int stride, const int *ids,
+                                    const int *firsts, const int *outputs, const int *counts, int meshlet_count,
+                                    int span, int span_index,
+                                    const struct float4x4 *mat, const struct float4x4 *viewport,
+                                    float guard_x, float guard_y,
+                                    float *xs, float *ys, float *zs, int *outcodes);
+extern void transform_quantized_span(const uint16_t *xs, const uint16_t *ys, const uint16_t *zs, int count,
+                                     int span, int span_index,
+                                     const struct float4x4 *mat, const struct float4x4 *viewport,
+                                     float guard_x, float guard_y,
+                                     float *xs_out, float *ys_out, float *zs_out, int *outcodes);
+
+struct raster_triangle;
+extern void raster_tile(uint32_t *color_buffer, float *depth_buffer,
+                        int layout, int width, int height,
+                        float *hiz_buffer, int hiz_width,
+                        uint8_t *tile_pending, uint32_t clear_color, float clear_depth,
+                        const struct raster_triangle *triangles,
+                        const int *bin_offsets, const int *bin_triangles,
+                        int tile_size, int tile_x, int tile_y, int tiles_x);
+extern void clear_tile(uint32_t *color_buffer, float *depth_buffer,
+                       int layout, int width, int height,
+                       float *hiz_buffer, int hiz_width,
+                       int tile_size, int tile_x, int tile_y,
+                       uint32_t clear_color, float clear_depth);
+
+/* Task graphs, from kernel/tasksys.cpp */
+typedef void (*ispc_graph_task_func)(void *data, int thread_index, int thread_count,
+                                     int task_index, int task_count);
+extern void *ISPCGraphCreate(void);
+extern int ISPCGraphAddNode(void *graph, ispc_graph_task_func func, void *data, int count);
+extern void ISPCGraphAddDependency(void *graph, int node, int dependency);
+extern int ISPCGraphRun(void *graph);
+extern void ISPCGraphDestroy(void *graph);
+
+extern int simd_target(void);
+extern int simd_width(void);
+
+extern void resolve_tiled(const uint32_t *tiled, uint32_t *linear, int width, int height,
+                          const uint8_t *tile_pending, int tile_size, int tiles_x,
+                          uint32_t clear_color);
+
+#define TILE_SIZE 64
+
+/* Coarse depth: the farthest depth of every HIZ_SIZE x HIZ_SIZE block of
+   zbuffer, kept current by the raster kernel.  Must match
+   kernel/raster.ispc, and TILE_SIZE must be a multiple of it. */
+#define HIZ_SIZE 8
+
+static float *hiz = NULL;
+static int hiz_width, hiz_height;
+
+/* With LAYOUT_TILED the rasterizer draws into `tiles` and zbuffer in
+   HIZ_SIZE x HIZ_SIZE blocks, hiz_width * hiz_height of them, and resolve()
+   copies the color into the caller's `buffer`. */
+static enum framebuffer_layout layout = LAYOUT_LINEAR;
+static uint32_t *tiles = NULL;
+
+/* clear() only records the clear values and marks every TILE_SIZE tile
+   pending; a pending tile's color, depth and HiZ are written on first use,
+   by the raster kernel or set().  resolve() fills in the tiles still
+   pending at the end of the frame. */
+static struct {
+    uint8_t *pending;
+    int tiles_x;
+    int tiles_y;
+    uint32_t color;
+    float depth;
+} deferred_clear = { .depth = 1.f };
+
+/* Clip outcodes written by the transform_*_span() kernels, must match
+   kernel/transform.ispc. */
+#define CLIP_LEFT    (1 << 0)
+#define CLIP_RIGHT   (1 << 1)
+#define CLIP_BOTTOM  (1 << 2)
+#define CLIP_TOP     (1 << 3)
+#define CLIP_NEAR    (1 << 4)
+#define CLIP_FAR     (1 << 5)
+#define GUARD_LEFT   (1 << 6)
+#define GUARD_RIGHT  (1 << 7)
+#define GUARD_BOTTOM (1 << 8)
+#define GUARD_TOP    (1 << 9)
+
+#define CLIP_FRUSTUM (CLIP_LEFT | CLIP_RIGHT | CLIP_BOTTOM | CLIP_TOP | CLIP_NEAR | CLIP_FAR)
+#define CLIP_GUARD   (GUARD_LEFT | GUARD_RIGHT | GUARD_BOTTOM | GUARD_TOP)
+
+/* Half extent of the guard band in pixels, measured from the screen center.
+   Triangles are only clipped against the near plane, or against the guard
+   band when they poke out of it; everything else is left to the bounding
+   box clamp in the rasterizer. */
+#define GUARD_BAND 8192.f
+
+static enum cull_mode cull_mode = CULL_BACK;
+
+void set_cull_mode(enum cull_mode mode)
+{
+    cull_mode = mode;
+}
+
+const char *kernel_target(int *lanes)
+{
+    /* Must match kernel/target.ispc */
+    static const char *names[] = { "sse2", "sse4", "avx", "avx2", "avx512knl", "avx512skx" };
+    int target = simd_target();
+
+    if (lanes)
+        *lanes = simd_width();
+    return target >= 0 && target < (int)(sizeof(names) / sizeof(names[0])) ? names[target] : "unknown";
+}
+
+static void allocate_buffers()
+{
+    hiz_width = (buffer_width + HIZ_SIZE - 1) / HIZ_SIZE;
+    hiz_height = (buffer_height + HIZ_SIZE - 1) / HIZ_SIZE;
+    hiz = realloc(hiz, sizeof(float) * hiz_width * hiz_height);
+
+    if (layout == LAYOUT_TILED) {
+        size_t size = sizeof(uint32_t) * hiz_width * hiz_height * HIZ_SIZE * HIZ_SIZE;
+        tiles = realloc(tiles, size);
+        zbuffer = realloc(zbuffer, size);
+    } else {
+        free(tiles);
+        tiles = NULL;
+        zbuffer = realloc(zbuffer, sizeof(float) * buffer_width * buffer_height);
+    }
+
+    /* Nothing valid survives a reallocation */
+    deferred_clear.tiles_x = (buffer_width + TILE_SIZE - 1) / TILE_SIZE;
+    deferred_clear.tiles_y = (buffer_height + TILE_SIZE - 1) / TILE_SIZE;
+    size_t tile_count = deferred_clear.tiles_x * deferred_clear.tiles_y;
+    deferred_clear.pending = realloc(deferred_clear.pending, tile_count);
+    memset(deferred_clear.pending, 1, tile_count);
+}
+
+void set_render_target(uint32_t *color, int width, int height)
+{
+    buffer = color;
+    buffer_width = width;
+    buffer_height = height;
+
+    allocate_buffers();
+}
+
+void set_framebuffer_layout(enum framebuffer_layout new_layout)
+{
+    layout = new_layout;
+
+    if (buffer)
+        allocate_buffers();
+}
+
+/* The buffer the rasterizer draws color into. */
+static uint32_t *color_target()
+{
+    return layout == LAYOUT_TILED ? tiles : buffer;
+}
+
+void clear(uint32_t color, float depth)
+{
+    profile_begin(STAGE_CLEAR);
+    deferred_clear.color = color;
+    deferred_clear.depth = depth;
+    memset(deferred_clear.pending, 1, deferred_clear.tiles_x * deferred_clear.tiles_y);
+    profile_end(STAGE_CLEAR);
+}
+
+void resolve()
+{
+    profile_begin(STAGE_RESOLVE);
+
+    if (layout == LAYOUT_TILED) {
+        resolve_tiled(tiles, buffer, buffer_width, buffer_height,
+                      deferred_clear.pending, TILE_SIZE, deferred_clear.tiles_x, deferred_clear.color);
+        profile_end(STAGE_RESOLVE);
+        return;
+    }
+
+    /* Only the color of the tiles still pending is visible.  They stay
+       pending, so their depth and HiZ are written on first use, as
+       clear_tile() does for the tiled layout. */
+    clear_targets((uint32_t *[]) { buffer },
+                  (uint32_t[]) { deferred_clear.color }, 1,
+                  buffer_width, buffer_height,
+                  deferred_clear.pending, TILE_SIZE);
+
+    profile_end(STAGE_RESOLVE);
+}
+
+static int pixel_index(int x, int y)
+{
+    if (layout == LAYOUT_TILED) {
+        int block = (y / HIZ_SIZE) * hiz_width + x / HIZ_SIZE;
+        return block * HIZ_SIZE * HIZ_SIZE + (y % HIZ_SIZE) * HIZ_SIZE + x % HIZ_SIZE;
+    }
+    return x + y * buffer_width;
+}
+
+static void set(int x, int y, uint32_t color)
+{
+    if (x >= buffer_width || x < 0 || y >= buffer_height || y < 0) return;
+
+    int tile = (y / TILE_SIZE) * deferred_clear.tiles_x + x / TILE_SIZE;
+    if (deferred_clear.pending[tile]) {
+        clear_tile(color_target(), zbuffer, layout, buffer_width, buffer_height,
+                   hiz, hiz_width,
+                   TILE_SIZE, x / TILE_SIZE, y / TILE_SIZE,
+                   deferred_clear.color, deferred_clear.depth);
+        deferred_clear.pending[tile] = 0;
+    }
+
+    color_target()[pixel_index(x, y)] = color;
+}
+
+struct rect {
+    float x;
+    float y;
+    float w;
+    float h;
+};
+
+static struct rect triangle_bbox(struct float4 vertices[3])
+{
+    struct rect bbox = { buffer_width - 1, buffer_height - 1, 0, 0 };
+
+    for (int i = 0; i < 3; ++i) {
+        bbox.x = min(bbox.x, vertices[i].x);
+        bbox.y = min(bbox.y, vertices[i].y);
+        bbox.w = max(bbox.w, vertices[i].x);
+        bbox.h = max(bbox.h, vertices[i].y);
+    }
+
+    if (bbox.w > buffer_width) bbox.w = buffer_width;
+    if (bbox.h > buffer_height) bbox.h = buffer_height;
+    if (bbox.x < 0) bbox.x = 0;
+    if (bbox.y < 0) bbox.y = 0;
+
+    return bbox;
+}
+
+/* A linear function over screen space, evaluated as a*x + b*y + c.
+   Layout must match kernel/raster.ispc. */
+struct plane {
+    float a;
+    float b;
+    float c;
+};
+
+static float plane_eval(struct plane p, float x, float y)
+{
+    return p.a * x + p.b * y + p.c;
+}
+
+/* Vertices are snapped to a fixed-point grid with SUBPIXEL_BITS of
+   sub-pixel precision before coverage is computed. */
+#define SUBPIXEL_BITS 8
+#define SUBPIXEL_ONE (1 << SUBPIXEL_BITS)
+
+/* An integer edge function in pixel units.  The pixel with integer
+   coordinates (x, y) (sampled at its center) is inside the edge when
+   a*x + b*y + c >= 0; the top-left fill rule is already folded into c.
+   Layout must match kernel/raster.ispc. */
+struct edge {
+    int32_t a;
+    int32_t b;
+    int64_t c;
+};
+
+/* Per-triangle setup.  `edge` decides coverage exactly, `bary[i]` is the
+   barycentric weight of vertex i (already divided by the triangle area)
+   and `depth` is the interpolated z, both evaluated at pixel centers. */
+struct triangle_setup {
+    struct plane bary[3];
+    struct plane depth;
+    struct edge edges[3];
+};
+
+static int64_t floor_div(int64_t a, int64_t b)
+{
+    int64_t q = a / b;
+    return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+static bool triangle_setup(struct float4 vertices[3], struct triangle_setup *setup)
+{
+    int32_t fx[3], fy[3];
+    for (int i = 0; i < 3; ++i) {
+        fx[i] = lrintf(vertices[i].x * SUBPIXEL_ONE);
+        fy[i] = lrintf(vertices[i].y * SUBPIXEL_ONE);
+    }
+
+    // Twice the signed area in sub-pixel units, positive for
+    // counter-clockwise triangles
+    int64_t area = (int64_t)(fx[1] - fx[0]) * (fy[2] - fy[0]) - (int64_t)(fy[1] - fy[0]) * (fx[2] - fx[0]);
+    if (area == 0) return false;
+
+    if (cull_mode == CULL_BACK && area < 0) return false;
+    if (cull_mode == CULL_FRONT && area > 0) return false;
+
+    // Coverage uses the counter-clockwise order, so inside is positive for
+    // every edge.  Edge i runs from vertex i + 1 to vertex i + 2.
+    int order[3] = { 0, 1, 2 };
+    if (area < 0) {
+        order[1] = 2;
+        order[2] = 1;
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        int va = order[(i + 1) % 3];
+        int vb = order[(i + 2) % 3];
+        int32_t a = fy[va] - fy[vb];
+        int32_t b = fx[vb] - fx[va];
+
+        // Top-left rule: counter-clockwise with y up, left edges point down
+        // (a > 0) and top edges point left (a == 0, b < 0).  Pixels exactly
+        // on any other edge belong to the neighbouring triangle.
+        bool top_left = a > 0 || (a == 0 && b < 0);
+
+        // Edge value at the center of pixel (0, 0), biased so the test is
+        // >= 0.  Since pixel centers are SUBPIXEL_ONE apart the value is
+        // SUBPIXEL_ONE * (a*x + b*y) + c0, and flooring c0 / SUBPIXEL_ONE
+        // keeps the sign exact while the per-pixel math stays in 32 bits.
+        int64_t c0 = (int64_t)a * (SUBPIXEL_ONE / 2 - fx[va]) + (int64_t)b * (SUBPIXEL_ONE / 2 - fy[va]);
+        if (!top_left) c0 -= 1;
+
+        setup->edges[i].a = a;
+        setup->edges[i].b = b;
+        setup->edges[i].c = floor_div(c0, SUBPIXEL_ONE);
+    }
+
+    // Interpolation planes from the snapped positions, in pixels
+    float inv_area = (float)SUBPIXEL_ONE * SUBPIXEL_ONE / (float)area;
+    setup->depth = (struct plane) { 0.f, 0.f, 0.f };
+    for (int i = 0; i < 3; ++i) {
+        int va = (i + 1) % 3;
+        int vb = (i + 2) % 3;
+        float ax = fx[va] / (float)SUBPIXEL_ONE, ay = fy[va] / (float)SUBPIXEL_ONE;
+        float bx = fx[vb] / (float)SUBPIXEL_ONE, by = fy[vb] / (float)SUBPIXEL_ONE;
+
+        setup->bary[i].a = (ay - by) * inv_area;
+        setup->bary[i].b = (bx - ax) * inv_area;
+        setup->bary[i].c = -(setup->bary[i].a * ax + setup->bary[i].b * ay);
+
+        setup->depth.a += setup->bary[i].a * vertices[i].z;
+        setup->depth.b += setup->bary[i].b * vertices[i].z;
+        setup->depth.c += setup->bary[i].c * vertices[i].z;
+    }
+
+    return true;
+}
+
+/* A set-up triangle waiting to be binned, with its bounding box in pixels.
+   Layout must match kernel/raster.ispc. */
+struct raster_triangle {
+    struct triangle_setup setup;
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+    float zmin;
+    uint32_t color[3];
+};
+
+/* Triangles collected by model(), and the per-tile lists built from them by
+   bin_triangles().  The triangles overlapping tile t are
+   indices[offsets[t] ... offsets[t + 1]). */
+static struct {
+    struct raster_triangle *triangles;
+    int triangle_count;
+    int triangle_capacity;
+
+    int *offsets;
+    int *indices;
+    int offset_capacity;
+    int index_capacity;
+
+    int tiles_x;
+    int tiles_y;
+} bins;
+
+static void triangle(struct float4 vertices[3], int color)
+{
+    struct rect bbox = triangle_bbox(vertices);
+
+    //line(bbox.x, bbox.y, bbox.x, bbox.h, 0x22222222, 0x22222222);
+    //line(bbox.x, bbox.h, bbox.w, bbox.h, 0x22222222, 0x22222222);
+    //line(bbox.w, bbox.h, bbox.w, bbox.y, 0x22222222, 0x22222222);
+    //line(bbox.w, bbox.y, bbox.x, bbox.y, 0x22222222, 0x22222222);
+
+    struct raster_triangle tri;
+    if (!triangle_setup(vertices, &tri.setup)) return;
+
+    tri.x0 = max((int)bbox.x, 0);
+    tri.y0 = max((int)bbox.y, 0);
+    tri.x1 = min((int)ceilf(bbox.w), buffer_width);
+    tri.y1 = min((int)ceilf(bbox.h), buffer_height);
+    if (tri.x0 >= tri.x1 || tri.y0 >= tri.y1) return;
+
+    tri.zmin = min(vertices[0].z, min(vertices[1].z, vertices[2].z));
+
+    tri.color[0] = color;
+    tri.color[1] = (color + 123123) * 123124;
+    tri.color[2] = (color) * 13124;
+
+    if (bins.triangle_count == bins.triangle_capacity) {
+        bins.triangle_capacity = bins.triangle_capacity ? bins.triangle_capacity * 2 : 1024;
+        bins.triangles = realloc(bins.triangles, sizeof(struct raster_triangle) * bins.triangle_capacity);
+    }
+    bins.triangles[bins.triangle_count++] = tri;
+}
+
+static void bin_triangles()
+{
+    bins.tiles_x = (buffer_width + TILE_SIZE - 1) / TILE_SIZE;
+    bins.tiles_y = (buffer_height + TILE_SIZE - 1) / TILE_SIZE;
+
+    int tile_count = bins.tiles_x * bins.tiles_y;
+    if (tile_count + 1 > bins.offset_capacity) {
+        bins.offset_capacity = tile_count + 1;
+        bins.offsets = realloc(bins.offsets, sizeof(int) * bins.offset_capacity);
+    }
+    memset(bins.offsets, 0, sizeof(int) * (tile_count + 1));
+
+    // First pass counts the triangles per tile, the prefix sum turns the
+    // counts into offsets and the second pass fills in the lists.
+    for (int i = 0; i < bins.triangle_count; ++i) {
+        struct raster_triangle *t = &bins.triangles[i];
+        for (int ty = t->y0 / TILE_SIZE; ty <= (t->y1 - 1) / TILE_SIZE; ++ty)
+            for (int tx = t->x0 / TILE_SIZE; tx <= (t->x1 - 1) / TILE_SIZE; ++tx)
+                bins.offsets[ty * bins.tiles_x + tx + 1]++;
+    }
+
+    for (int i = 0; i < tile_count; ++i)
+        bins.offsets[i + 1] += bins.offsets[i];
+
+    int index_count = bins.offsets[tile_count];
+    if (index_count > bins.index_capacity) {
+        bins.index_capacity = index_count * 2;
+        bins.indices = realloc(bins.indices, sizeof(int) * bins.index_capacity);
+    }
+
+    for (int i = 0; i < bins.triangle_count; ++i) {
+        struct raster_triangle *t = &bins.triangles[i];
+        for (int ty = t->y0 / TILE_SIZE; ty <= (t->y1 - 1) / TILE_SIZE; ++ty)
+            for (int tx = t->x0 / TILE_SIZE; tx <= (t->x1 - 1) / TILE_SIZE; ++tx)
+                bins.indices[bins.offsets[ty * bins.tiles_x + tx]++] = i;
+    }
+
+    // The fill pass advanced every offset to the start of the next tile;
+    // shift them back.
+    for (int i = tile_count; i > 0; --i)
+        bins.offsets[i] = bins.offsets[i - 1];
+    bins.offsets[0] = 0;
+}
+
+/* Screen-space positions and clip outcodes of the vertices of the model
+   being drawn, one SoA stream per component, filled once per model() call. */
+static struct {
+    float *x;
+    float *y;
+    float *z;
+    int *outcode;
+    uint32_t capacity;
+} screen;
+
+/* Signed distance of a clip-space vertex to one of the clipping planes;
+   the vertex is kept when it is >= 0. */
+static float clip_distance(struct float4 v, int plane, float guard_x, float guard_y)
+{
+    switch (plane) {
+    case CLIP_NEAR:    return v.z;
+    case GUARD_LEFT:   return v.x + guard_x * v.w;
+    case GUARD_RIGHT:  return guard_x * v.w - v.x;
+    case GUARD_BOTTOM: return v.y + guard_y * v.w;
+    case GUARD_TOP:    return guard_y * v.w - v.y;
+    }
+    return 0.f;
+}
+
+/* Sutherland-Hodgman against a single plane, returns the new vertex count. */
+static int clip_polygon(const struct float4 *in, int count, struct float4 *out,
+                        int plane, float guard_x, float guard_y)
+{
+    int n = 0;
+    for (int i = 0; i < count; ++i) {
+        struct float4 a = in[i];
+        struct float4 b = in[(i + 1) % count];
+        float da = clip_distance(a, plane, guard_x, guard_y);
+        float db = clip_distance(b, plane, guard_x, guard_y);
+
+        if (da >= 0.f) out[n++] = a;
+        if ((da >= 0.f) != (db >= 0.f)) {
+            float t = da / (da - db);
+            out[n++] = (struct float4) {
+                a.x + (b.x - a.x) * t,
+                a.y + (b.y - a.y) * t,
+                a.z + (b.z - a.z) * t,
+                a.w + (b.w - a.w) * t,
+            };
+        }
+    }
+    return n;
+}
+
+/* Slow path for triangles crossing the near plane or the guard band: clip
+   in homogeneous space, then project and fan out the resulting polygon. */
+static void clipped_triangle(struct float4 vertices[3], int planes,
+                             struct float4x4 viewport, float guard_x, float guard_y, int color)
+{
+    // Each plane can add at most one vertex
+    struct float4 poly[2][3 + 5];
+    int count = 3;
+    int cur = 0;
+
+    for (int i = 0; i < 3; ++i)
+        poly[cur][i] = vertices[i];
+
+    for (int plane = CLIP_NEAR; plane <= GUARD_TOP && count >= 3; plane <<= 1) {
+        if (!(planes & plane)) continue;
+        count = clip_polygon(poly[cur], count, poly[!cur], plane, guard_x, guard_y);
+        cur = !cur;
+    }
+
+    if (count < 3) return;
+
+    for (int i = 0; i < count; ++i) {
+        struct float4 v = vec4_muls(poly[cur][i], 1.f / poly[cur][i].w);
+        poly[cur][i] = vec4_transform(v, viewport);
+    }
+
+    for (int i = 1; i + 1 < count; ++i) {
+        triangle((struct float4[3]) {
+            poly[cur][0],
+            poly[cur][i],
+            poly[cur][i + 1]
+        }, color);
+    }
+}
+
+/* What model() and draw_mesh() have in common: indices of either width,
+   and positions, as floats or quantized, to clip triangles with */
+struct draw_call {
+    uint32_t index_count;
+    uint32_t vertex_count;
+    const uint16_t *indices16;
+    const uint32_t *indices32;
+    const struct vvertex *vertices;
+    const uint16_t *quantized[3];
+};
+
+static uint32_t draw_index(const struct draw_call *call, uint32_t i)
+{
+    return call->indices16 ? call->indices16[i] : call->indices32[i];
+}
+
+static struct float4 draw_position(const struct draw_call *call, uint32_t vertex)
+{
+    if (call->vertices) {
+        struct float3 p = call->vertices[vertex].position;
+        return (struct float4) { p.x, p.y, p.z, 1.f };
+    }
+    return (struct float4) {
+        call->quantized[0][vertex], call->quantized[1][vertex], call->quantized[2][vertex], 1.f
+    };
+}
+
+/* What setting up a triangle needs besides its vertices */
+struct draw_setup {
+    struct float4x4 transform;
+    struct float4x4 viewport;
+    float guard_x;
+    float guard_y;
+};
+
+static struct draw_setup draw_setup(struct float4x4 mat)
+{
+    return (struct draw_setup) {
+        .transform = mat,
+        .viewport = mat4_viewport(0, 0, buffer_height, buffer_width),
+        .guard_x = GUARD_BAND * 2.f / buffer_width,
+        .guard_y = GUARD_BAND * 2.f / buffer_height,
+    };
+}
+
+static void reserve_screen(uint32_t count)
+{
+    if (count > screen.capacity) {
+        screen.capacity = count;
+        screen.x = realloc(screen.x, sizeof(float) * screen.capacity);
+        screen.y = realloc(screen.y, sizeof(float) * screen.capacity);
+        screen.z = realloc(screen.z, sizeof(float) * screen.capacity);
+        screen.outcode = realloc(screen.outcode, sizeof(int) * screen.capacity);
+    }
+}
+
+/* Rejects, clips or bins the triangle whose transformed vertices are
+   slots[] of `screen`, and model vertices vertices[] of `call`. */
+static void setup_triangle(const struct draw_call *call, const struct draw_setup *setup,
+                           const uint32_t slots[3], const uint32_t vertices[3], int color)
+{
+    uint32_t ai = slots[0], bi = slots[1], ci = slots[2];
+
+    int oa = screen.outcode[ai];
+    int ob = screen.outcode[bi];
+    int oc = screen.outcode[ci];
+
+    // Trivially reject triangles entirely outside one frustum plane
+    if (oa & ob & oc & CLIP_FRUSTUM) return;
+
+    int planes = (oa | ob | oc) & (CLIP_NEAR | CLIP_GUARD);
+    if (planes) {
+        clipped_triangle((struct float4[3]) {
+            vec4_transform(draw_position(call, vertices[0]), setup->transform),
+            vec4_transform(draw_position(call, vertices[1]), setup->transform),
+            vec4_transform(draw_position(call, vertices[2]), setup->transform)
+        }, planes, setup->viewport, setup->guard_x, setup->guard_y, color);
+        return;
+    }
+
+    triangle((struct float4[3]) {
+        { screen.x[ai], screen.y[ai], screen.z[ai], 1.f },
+        { screen.x[bi], screen.y[bi], screen.z[bi], 1.f },
+        { screen.x[ci], screen.y[ci], screen.z[ci], 1.f }
+    }, color);
+}
+
+/* Meshlets left after culling, for draw_meshlets(): their index in the
+   meshlet_model, where their vertices start in the model's meshlet vertex
+   list, where in `screen` they are transformed to, and how many there
+   are. */
+static struct {
+    uint32_t *meshlets;
+    int *firsts;
+    int *outputs;
+    int *counts;
+    uint32_t capacity;
+} visible;
+
+/* Draws run as a task graph, see ISPCGraphRun() in kernel/tasksys.cpp:
+   the transform spans, then setup and binning as a continuation of the
+   last of them, then one task per tile, which start as soon as binning is
+   done rather than after a sync of every stage.  Until ISPCGraphRun()
+   returns, only the graph's tasks touch `screen` and `bins`.  The tasks
+   only take timestamps; run_draw() hands them to the profiler. */
+#define TRANSFORM_SPAN 4096
+
+/* Meshlets per transform task: up to 64 vertices each, so about as much
+   work per task as TRANSFORM_SPAN vertices */
+#define MESHLET_SPAN 64
+
+struct draw_pass {
+    const struct draw_call *call;
+    struct draw_setup setup;
+
+    /* With draw_meshlets(), the first meshlet_count `visible` meshlets of
+       `meshlets` are drawn instead of call's indices */
+    const struct meshlet_model *meshlets;
+    int meshlet_count;
+
+    /* Set by draw_setup_task() */
+    double setup_start;
+    double raster_start;
+};
+
+static void draw_transform_task(void *data, int thread_index, int thread_count, int task_index, int task_count)
+{
+    (void)thread_index; (void)thread_count; (void)task_count;
+    const struct draw_pass *pass = data;
+    const struct draw_call *call = pass->call;
+    const struct draw_setup *setup = &pass->setup;
+
+    if (pass->meshlets) {
+        transform_meshlets_span(call->vertices, sizeof(struct vvertex) / sizeof(float),
+                                (const int *)pass->meshlets->vertices,
+                                visible.firsts, visible.outputs, visible.counts, pass->meshlet_count,
+                                MESHLET_SPAN, task_index,
+                                &setup->transform, &setup->viewport, setup->guard_x, setup->guard_y,
+                                screen.x, screen.y, screen.z, screen.outcode);
+    } else if (call->vertices) {
+        transform_vertices_span(call->vertices, sizeof(struct vvertex) / sizeof(float), call->vertex_count,
+                                TRANSFORM_SPAN, task_index,
+                                &setup->transform, &setup->viewport, setup->guard_x, setup->guard_y,
+                                screen.x, screen.y, screen.z, screen.outcode);
+    } else {
+        transform_quantized_span(call->quantized[0], call->quantized[1], call->quantized[2], call->vertex_count,
+                                 TRANSFORM_SPAN, task_index,
+                                 &setup->transform, &setup->viewport, setup->guard_x, setup->guard_y,
+                                 screen.x, screen.y, screen.z, screen.outcode);
+    }
+}
+
+static void setup_meshlets(const struct draw_pass *pass)
+{
+    const struct meshlet_model *meshlets = pass->meshlets;
+
+    for (int i = 0; i < pass->meshlet_count; ++i) {
+        const struct meshlet *m = &meshlets->meshlets[visible.meshlets[i]];
+        const uint32_t *ids = &meshlets->vertices[m->vertex_offset];
+
+        for (uint32_t t = 0; t < m->triangle_count; ++t) {
+            const uint8_t *local = &meshlets->triangles[(m->triangle_offset + t) * 3];
+            uint32_t slots[3], vertices[3];
+            for (int k = 0; k < 3; ++k) {
+                slots[k] = visible.outputs[i] + local[k];
+                vertices[k] = ids[local[k]];
+            }
+            // The same color as model() gives the triangle
+            setup_triangle(pass->call, &pass->setup, slots, vertices, ((m->triangle_offset + t) * 3 + 100) * 409020);
+        }
+    }
+}
+
+static void draw_setup_task(void *data, int thread_index, int thread_count, int task_index, int task_count)
+{
+    (void)thread_index; (void)thread_count; (void)task_index; (void)task_count;
+    struct draw_pass *pass = data;
+    const struct draw_call *call = pass->call;
+
+    pass->setup_start = profile_now();
+    bins.triangle_count = 0;
+
+    if (pass->meshlets) {
+        setup_meshlets(pass);
+    } else {
+        for (uint32_t i = 0; i < call->index_count; i += 3) {
+            uint32_t vertices[3] = { draw_index(call, i), draw_index(call, i + 1), draw_index(call, i + 2) };
+            setup_triangle(call, &pass->setup, vertices, vertices, (i + 100) * 409020);
+        }
+    }
+
+    if (bins.triangle_count > 0)
+        bin_triangles();
+    pass->raster_start = profile_now();
+}
+
+static void draw_raster_task(void *data, int thread_index, int thread_count, int task_index, int task_count)
+{
+    (void)data; (void)thread_index; (void)thread_count; (void)task_count;
+    if (bins.triangle_count == 0)
+        return;
+
+    raster_tile(color_target(), zbuffer, layout, buffer_width, buffer_height,
+                hiz, hiz_width,
+                deferred_clear.pending, deferred_clear.color, deferred_clear.depth,
+                bins.triangles, bins.offsets, bins.indices,
+                TILE_SIZE, task_index % bins.tiles_x, task_index / bins.tiles_x, bins.tiles_x);
+}
+
+/* Runs the graph of `pass`, with transform_tasks transform spans, and
+   profiles its stages. */
+static void run_draw(struct draw_pass *pass, int transform_tasks)
+{
+    void *graph = ISPCGraphCreate();
+    int transform = ISPCGraphAddNode(graph, draw_transform_task, pass, transform_tasks);
+    int setup = ISPCGraphAddNode(graph, draw_setup_task, pass, 1);
+    int raster = ISPCGraphAddNode(graph, draw_raster_task, pass,
+                                  deferred_clear.tiles_x * deferred_clear.tiles_y);
+    ISPCGraphAddDependency(graph, setup, transform);
+    ISPCGraphAddDependency(graph, raster, setup);
+
+    // A chain, so it can't have a cycle
+    double start = profile_now();
+    ISPCGraphRun(graph);
+    double end = profile_now();
+    ISPCGraphDestroy(graph);
+
+    profile_add(STAGE_TRANSFORM, pass->setup_start - start);
+    profile_add(STAGE_SETUP, pass->raster_start - pass->setup_start);
+    profile_add(STAGE_RASTER, end - pass->raster_start);
+}
+
+static void draw(const struct draw_call *call, struct float4x4 mat)
+{
+    struct draw_pass pass = { .call = call, .setup = draw_setup(mat) };
+    reserve_screen(call->vertex_count);
+    run_draw(&pass, (call->vertex_count + TRANSFORM_SPAN - 1) / TRANSFORM_SPAN);
+}
+
+void model(struct vmodel model, struct float4x4 mat)
+{
+    struct draw_call call = {
+        .index_count = model.index_len,
+        .vertex_count = model.vertex_len,
+        .indices16 = model.indices,
+        .vertices = model.vertices,
+    };
+    draw(&call, mat);
+}
+
+void draw_mesh(const struct mesh *mesh, struct float4x4 mat)
+{
+    struct draw_call call = {
+        .index_count = mesh->index_count,
+        .vertex_count = mesh->vertex_count,
+        .indices16 = mesh->indices16,
+        .indices32 = mesh->indices32,
+        .quantized = { mesh->position[0], mesh->position[1], mesh->position[2] },
+    };
+    draw(&call, mat4_mul(mesh_dequantize(mesh), mat));
+}
+
+/* The frustum planes of `mat` in model space, as the outcodes have it:
+   -w <= x <= w, -w <= y <= w and 0 <= z <= w, with xyz normalized and
+   dot((p, 1), plane) >= 0 inside. */
+static void frustum_planes(const struct float4x4 *mat, struct float4 planes[6])
+{
+    for (int i = 0; i < 6; ++i) {
+        int axis = i / 2;
+        float sign = (i % 2) ? -1.f : 1.f;
+        // The near plane is z >= 0, every other one w +- x, y or z >= 0
+        float w = (i == 4) ? 0.f : 1.f;
+
+        float p[4];
+        for (int r = 0; r < 4; ++r)
+            p[r] = w * mat->m[r][3] + sign * mat->m[r][axis];
+
+        float length = sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+        float scale = length > 0.f ? 1.f / length : 0.f;
+        planes[i] = (struct float4) { p[0] * scale, p[1] * scale, p[2] * scale, p[3] * scale };
+    }
+}
+
+static float det3(float a0, float a1, float a2, float b0, float b1, float b2, float c0, float c1, float c2)
+{
+    return a0 * (b1 * c2 - b2 * c1) - a1 * (b0 * c2 - b2 * c0) + a2 * (b0 * c1 - b1 * c0);
+}
+
+/* The camera in model space, in homogeneous coordinates: the one point
+   `mat` takes to x = y = w = 0.  Its w is 0 for an orthographic mat. */
+static struct float4 model_eye(const struct float4x4 *mat)
+{
+    const float (*m)[4] = mat->m;
+    float minor[4];
+    for (int skip = 0; skip < 4; ++skip) {
+        int r[3], n = 0;
+        for (int i = 0; i < 4; ++i) {
+            if (i != skip)
+                r[n++] = i;
+        }
+        minor[skip] = det3(m[r[0]][0], m[r[0]][1], m[r[0]][3],
+                           m[r[1]][0], m[r[1]][1], m[r[1]][3],
+                           m[r[2]][0], m[r[2]][1], m[r[2]][3]);
+    }
+    return (struct float4) { minor[0], -minor[1], minor[2], -minor[3] };
+}
+
+int draw_meshlets(const struct vmodel *model, const struct meshlet_model *meshlets, struct float4x4 mat)
+{
+    struct draw_call call = { .vertices = model->vertices };
+    struct draw_pass pass = { .call = &call, .setup = draw_setup(mat), .meshlets = meshlets };
+
+    if (meshlets->meshlet_count > visible.capacity) {
+        visible.capacity = meshlets->meshlet_count;
+        visible.meshlets = realloc(visible.meshlets, sizeof(uint32_t) * visible.capacity);
+        visible.firsts = realloc(visible.firsts, sizeof(int) * visible.capacity);
+        visible.outputs = realloc(visible.outputs, sizeof(int) * visible.capacity);
+        visible.counts = realloc(visible.counts, sizeof(int) * visible.capacity);
+    }
+
+    profile_begin(STAGE_TRANSFORM);
+
+    struct float4 planes[6];
+    frustum_planes(&mat, planes);
+
+    // Which way the cones have to point for every triangle to be culled.
+    // Triangles facing the camera are counter-clockwise on screen when the
+    // camera's w is positive; it flips with the handedness of mat.
+    struct float4 eye_h = model_eye(&mat);
+    struct float3 eye = { 0 };
+    float cone_sign = 0.f;
+    if (cull_mode != CULL_NONE && eye_h.w != 0.f) {
+        eye = (struct float3) { eye_h.x / eye_h.w, eye_h.y / eye_h.w, eye_h.z / eye_h.w };
+        cone_sign = (eye_h.w > 0.f) == (cull_mode == CULL_BACK) ? 1.f : -1.f;
+    }
+
+    int count = 0;
+    uint32_t vertex_count = 0;
+    for (uint32_t i = 0; i < meshlets->meshlet_count; ++i) {
+        const struct meshlet *m = &meshlets->meshlets[i];
+
+        bool outside = false;
+        for (int p = 0; p < 6 && !outside; ++p) {
+            outside = planes[p].x * m->center.x + planes[p].y * m->center.y + planes[p].z * m->center.z +
+                      planes[p].w < -m->radius;
+        }
+        if (outside) continue;
+
+        if (cone_sign != 0.f) {
+            struct float3 d = vec3_sub(m->center, eye);
+            if (cone_sign * vec3_dot(d, m->cone_axis) >= m->cone_cutoff * vec3_length(d) + m->radius)
+                continue;
+        }
+
+        visible.meshlets[count] = i;
+        visible.firsts[count] = m->vertex_offset;
+        visible.outputs[count] = vertex_count;
+        visible.counts[count] = m->vertex_count;
+        vertex_count += m->vertex_count;
+        count++;
+    }
+
+    profile_end(STAGE_TRANSFORM);
+
+    reserve_screen(vertex_count);
+    pass.meshlet_count = count;
+    run_draw(&pass, (count + MESHLET_SPAN - 1) / MESHLET_SPAN);
+    return count;
+}
+
+static float randf()
+{
+    return (float)(rand() / (float)RAND_MAX);
+}
+
+#define SWAP(T, a, b) do { T tmp = a; a = b; b = tmp; } while (0)
+
+static uint32_t lerpu(uint32_t a, uint32_t b, float t)
+{
+    const uint32_t rb = 0xff00ff;
+    const uint32_t g = 0x00ff00;
+
+    uint32_t f2 = 256 * t;
+    uint32_t f1 = 256 - f2;
+
+    return (((((a & rb) * f1) + ((b & rb) * f2)) >> 8) & rb)
+         | (((((a & g)  * f1) + ((b & g)  * f2)) >> 8) & g);
+}
+
+void line(float x0, float y0, float x1, float y1, uint32_t color0, uint32_t color1)
+{
+    bool steep = false;
+    if (abs(x0 - x1) < abs(y0 - y1)) {
+        SWAP(float, x0, y0);
+        SWAP(float, x1, y1);
+        steep = true;
+    }
+    if (x0>x1) {
+        SWAP(float, x0, x1);
+        SWAP(float, y0, y1);
+    }
+    int dx = x1 - x0;
+    int dy = y1 - y0;
+    int derror2 = abs(dy) * 2;
+    int error2 = 0;
+    int y = y0;
+    for (int x = x0; x <= x1; x++) {
+        float t = (x - x0) / (float)(x1 - x0);
+        uint32_t c = lerpu(color0, color1, t);
+        if (steep) {
+            set(y, x, c);
+        }
+        else {
+            set(x, y, c);
+        }
+        error2 += derror2;
+        if (error2 > dx) {
+            y += (y1>y0 ? 1 : -1);
+            error2 -= dx * 2;
+        }
+    }
+}
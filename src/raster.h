@@ -0,0 +1,64 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mesh.h"
+#include "meshlet.h"
+#include "rmath.h"
+
+/* The render target. `buffer` is owned by the caller (a DIB section on
+   Windows, plain aligned memory in the headless benchmark), `zbuffer` is
+   owned by the rasterizer, resized by set_render_target() and stored in the
+   current framebuffer layout.  Clearing is deferred per 64x64 tile: tiles
+   nothing has drawn into since clear() only have their color written, by
+   resolve(); their depth is not written at all. */
+extern uint32_t *buffer;
+extern float *zbuffer;
+extern int buffer_width, buffer_height;
+
+void set_render_target(uint32_t *color, int width, int height);
+
+/* How the rasterizer stores color and depth.  LAYOUT_LINEAR draws straight
+   into `buffer`.  LAYOUT_TILED draws into internal buffers of 8x8 pixel
+   blocks, which keeps each block in a few cache lines, and only reaches
+   `buffer` once resolve() is called. */
+enum framebuffer_layout {
+    LAYOUT_LINEAR,
+    LAYOUT_TILED,
+};
+
+void set_framebuffer_layout(enum framebuffer_layout layout);
+
+/* Which triangles model() discards by winding.  Front faces are counter-
+   clockwise on screen. */
+enum cull_mode {
+    CULL_NONE,
+    CULL_BACK,
+    CULL_FRONT,
+};
+
+void set_cull_mode(enum cull_mode mode);
+
+/* The instruction set the kernels run with, picked at startup from those
+   they were built for, and how many lanes wide they are. */
+const char *kernel_target(int *lanes);
+
+/* Cheap: only marks every tile as cleared, see `buffer`. */
+void clear(uint32_t color, float depth);
+void line(float x0, float y0, float x1, float y1, uint32_t color0, uint32_t color1);
+void model(struct vmodel model, struct float4x4 mat);
+/* Like model(), but transforms the quantized positions as they are, with
+   their dequantization folded into `mat`. */
+void draw_mesh(const struct mesh *mesh, struct float4x4 mat);
+/* Like model(), but first culls whole meshlets against the frustum and,
+   following set_cull_mode(), by their normal cones, and only transforms
+   the vertices of the rest.  Returns how many meshlets were drawn. */
+int draw_meshlets(const struct vmodel *model, const struct meshlet_model *meshlets, struct float4x4 mat);
+/* Makes the last clear() and everything drawn since visible in `buffer`. */
+void resolve(void);
+
+#endif
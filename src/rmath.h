@@ -1,3 +1,6 @@
+#ifndef RMATH_H
+#define RMATH_H
+
 struct float2 {
     float x;
     float y;
@@ -36,6 +39,50 @@ static struct float4x4 mat4_identity();
 static struct float4x4 mat4_mul(struct float4x4 a, struct float4x4 b);
 static struct float4x4 mat4_perspective_RH(float fov, float aspect, float n, float f);
 static struct float4x4 mat4_look_at_RH(struct float3 pos, struct float3 target, struct float3 up);
+static struct float4x4 mat4_normal(const struct float4x4 *m);
+
+/* Batch helpers over SoA streams of count elements: xs[i], ys[i], zs[i]
+   (and ws[i]) are the components of element i.  Matrices are passed by
+   pointer.  Outputs may be the same arrays as the inputs.
+
+   soa_transform_points   points (x, y, z, 1) * m, into homogeneous x, y, z, w
+   soa_project            divides x, y and z by w
+   soa_viewport           points (x, y, z, 1) * viewport, dropping w
+   soa_transform_normals  normals * upper 3x3 of m, renormalized; m should
+                          come from mat4_normal()
+
+   Built with RMATH_ISPC these run the kernels in kernel/rmath.ispc,
+   otherwise the *_scalar versions below, which are always available. */
+static void soa_transform_points_scalar(const float *xs, const float *ys, const float *zs, int count,
+                                        const struct float4x4 *m,
+                                        float *out_x, float *out_y, float *out_z, float *out_w);
+static void soa_project_scalar(const float *xs, const float *ys, const float *zs, const float *ws, int count,
+                               float *out_x, float *out_y, float *out_z);
+static void soa_viewport_scalar(const float *xs, const float *ys, const float *zs, int count,
+                                const struct float4x4 *viewport,
+                                float *out_x, float *out_y, float *out_z);
+static void soa_transform_normals_scalar(const float *xs, const float *ys, const float *zs, int count,
+                                         const struct float4x4 *m,
+                                         float *out_x, float *out_y, float *out_z);
+
+#ifdef RMATH_ISPC
+extern void soa_transform_points(const float *xs, const float *ys, const float *zs, int count,
+                                 const struct float4x4 *m,
+                                 float *out_x, float *out_y, float *out_z, float *out_w);
+extern void soa_project(const float *xs, const float *ys, const float *zs, const float *ws, int count,
+                        float *out_x, float *out_y, float *out_z);
+extern void soa_viewport(const float *xs, const float *ys, const float *zs, int count,
+                         const struct float4x4 *viewport,
+                         float *out_x, float *out_y, float *out_z);
+extern void soa_transform_normals(const float *xs, const float *ys, const float *zs, int count,
+                                  const struct float4x4 *m,
+                                  float *out_x, float *out_y, float *out_z);
+#else
+#define soa_transform_points soa_transform_points_scalar
+#define soa_project soa_project_scalar
+#define soa_viewport soa_viewport_scalar
+#define soa_transform_normals soa_transform_normals_scalar
+#endif
 
 static float vec3_dot(struct float3 a, struct float3 b)
 {
@@ -194,3 +241,95 @@ static struct float4x4 mat4_viewport(float l, float b, float t, float r)
     }};
 }
 
+/* The matrix that transforms normals like m transforms points: the
+   inverse transpose of its upper 3x3, which for row vectors is the
+   cofactor matrix over the determinant. */
+static struct float4x4 mat4_normal(const struct float4x4 *m)
+{
+    const float (*a)[4] = m->m;
+    struct float4x4 n = mat4_identity();
+
+    n.m[0][0] = a[1][1] * a[2][2] - a[1][2] * a[2][1];
+    n.m[0][1] = a[1][2] * a[2][0] - a[1][0] * a[2][2];
+    n.m[0][2] = a[1][0] * a[2][1] - a[1][1] * a[2][0];
+    n.m[1][0] = a[0][2] * a[2][1] - a[0][1] * a[2][2];
+    n.m[1][1] = a[0][0] * a[2][2] - a[0][2] * a[2][0];
+    n.m[1][2] = a[0][1] * a[2][0] - a[0][0] * a[2][1];
+    n.m[2][0] = a[0][1] * a[1][2] - a[0][2] * a[1][1];
+    n.m[2][1] = a[0][2] * a[1][0] - a[0][0] * a[1][2];
+    n.m[2][2] = a[0][0] * a[1][1] - a[0][1] * a[1][0];
+
+    float det = a[0][0] * n.m[0][0] + a[0][1] * n.m[0][1] + a[0][2] * n.m[0][2];
+    if (det == 0.f)
+        return mat4_identity();
+
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            n.m[i][j] /= det;
+    return n;
+}
+
+static void soa_transform_points_scalar(const float *xs, const float *ys, const float *zs, int count,
+                                        const struct float4x4 *m,
+                                        float *out_x, float *out_y, float *out_z, float *out_w)
+{
+    const float (*b)[4] = m->m;
+
+    for (int i = 0; i < count; i++) {
+        float x = xs[i], y = ys[i], z = zs[i];
+
+        out_x[i] = (x * b[0][0]) + (y * b[1][0]) + (z * b[2][0]) + b[3][0];
+        out_y[i] = (x * b[0][1]) + (y * b[1][1]) + (z * b[2][1]) + b[3][1];
+        out_z[i] = (x * b[0][2]) + (y * b[1][2]) + (z * b[2][2]) + b[3][2];
+        out_w[i] = (x * b[0][3]) + (y * b[1][3]) + (z * b[2][3]) + b[3][3];
+    }
+}
+
+static void soa_project_scalar(const float *xs, const float *ys, const float *zs, const float *ws, int count,
+                               float *out_x, float *out_y, float *out_z)
+{
+    for (int i = 0; i < count; i++) {
+        float rw = 1.f / ws[i];
+
+        out_x[i] = xs[i] * rw;
+        out_y[i] = ys[i] * rw;
+        out_z[i] = zs[i] * rw;
+    }
+}
+
+static void soa_viewport_scalar(const float *xs, const float *ys, const float *zs, int count,
+                                const struct float4x4 *viewport,
+                                float *out_x, float *out_y, float *out_z)
+{
+    const float (*b)[4] = viewport->m;
+
+    for (int i = 0; i < count; i++) {
+        float x = xs[i], y = ys[i], z = zs[i];
+
+        out_x[i] = (x * b[0][0]) + (y * b[1][0]) + (z * b[2][0]) + b[3][0];
+        out_y[i] = (x * b[0][1]) + (y * b[1][1]) + (z * b[2][1]) + b[3][1];
+        out_z[i] = (x * b[0][2]) + (y * b[1][2]) + (z * b[2][2]) + b[3][2];
+    }
+}
+
+static void soa_transform_normals_scalar(const float *xs, const float *ys, const float *zs, int count,
+                                         const struct float4x4 *m,
+                                         float *out_x, float *out_y, float *out_z)
+{
+    const float (*b)[4] = m->m;
+
+    for (int i = 0; i < count; i++) {
+        struct float3 n = {
+            (xs[i] * b[0][0]) + (ys[i] * b[1][0]) + (zs[i] * b[2][0]),
+            (xs[i] * b[0][1]) + (ys[i] * b[1][1]) + (zs[i] * b[2][1]),
+            (xs[i] * b[0][2]) + (ys[i] * b[1][2]) + (zs[i] * b[2][2]),
+        };
+        n = vec3_normalize(n);
+
+        out_x[i] = n.x;
+        out_y[i] = n.y;
+        out_z[i] = n.z;
+    }
+}
+
+#endif